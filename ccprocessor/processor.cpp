@@ -26,10 +26,23 @@
 #include <sstream>
 #include <iomanip>
 #include <mutex>
+#include <memory>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <exception>
+#include <list>
+#include <algorithm>
+#include <unordered_map>
+#include <cstring>
+#include <array>
+#include <limits>
+#include <type_traits>
 #include <atomic>
 #include <fstream>
 #include <thread>
 #include <chrono>
+#include <random>
 using namespace std::chrono_literals;
 
 #include <cryptopp/sha.h>
@@ -48,7 +61,10 @@ using namespace std::chrono_literals;
 #include <zmqpp/socket_types.hpp>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <boost/multiprecision/cpp_int.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include "Address.pb.h"
 #include "AskOrder.pb.h"
@@ -97,8 +113,16 @@ static const char PROCESSED_BLOCK[] = "9000";
 //static_assert(sizeof(PROCESSED_BLOCK) / sizeof(char) - 1 == PREFIX_LENGTH);
 static const char FEE[] = "0100";
 //static_assert(sizeof(FEE) / sizeof(char) - 1 == PREFIX_LENGTH);
+static const char EXPIRY[] = "0200";
+//static_assert(sizeof(EXPIRY) / sizeof(char) - 1 == PREFIX_LENGTH);
+static const char FEE_LEDGER[] = "0300";
+//static_assert(sizeof(FEE_LEDGER) / sizeof(char) - 1 == PREFIX_LENGTH);
 
 static const char* PROCESSED_BLOCK_ID = "000000000000000000000000000000000000000000000000000000000000";
+static const char* EXPIRY_SWEPT_ID = "000000000000000000000000000000000000000000000000000000000001";
+static const char* HOUSEKEEPING_CURSOR_ID = "000000000000000000000000000000000000000000000000000000000002";
+static const char* FEE_LEDGER_SWEPT_ID = "000000000000000000000000000000000000000000000000000000000003";
+static const char* FEE_LEDGER_VERSION_ID = "000000000000000000000000000000000000000000000000000000000004";
 
 static char const* RPC_FAILURE = "Failed to process RPC response";
 static char const* DATA = "data";
@@ -129,6 +153,17 @@ static const int BLOCKS_IN_PERIOD = YEAR_OF_BLOCKS * 6;
 static const boost::multiprecision::cpp_int BLOCKS_IN_PERIOD_UPDATE1 = 2500000;
 static const int REMAINDER_OF_LAST_PERIOD = 2646631;
 static const int BLOCK_REWARD_PROCESSING_COUNT = 10;
+static const int EXPIRY_BUCKET_BLOCKS = 100;
+static const int EXPIRY_BUCKET_DIGITS = 12;
+static const std::size_t HOUSEKEEPING_BATCH_SIZE = 1000;
+static const std::size_t HOUSEKEEPING_DECIDE_BATCH = 256;
+static const int FEE_LEDGER_BUCKET_BLOCKS = 1;
+static const int FEE_LEDGER_BUCKET_DIGITS = 12;
+static const char* FEE_LEDGER_VERSION = "1";
+static const std::size_t PREFIX_SCAN_PAGES_AHEAD = 4;
+static const int TRANSITION_CHECKPOINT_BLOCKS = 1000;
+static const std::size_t REPLAY_WINDOW = 256;
+static const std::size_t SIGHASH_CACHE_SIZE = 4096;
 
 static char const* TX_FEE_STRING = "10000000000000000";
 static boost::multiprecision::cpp_int TX_FEE(TX_FEE_STRING);
@@ -151,17 +186,229 @@ static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("sawtooth.Transactio
 
 static bool transitioning;
 
+// a transaction of the chain history replayed while transitioning, it refers into the mapped transition data
 struct Tx
 {
-    std::string sighash;
-    std::string guid;
-    std::vector<std::uint8_t> payload;
+    boost::string_ref sighash;
+    boost::string_ref guid;
+    boost::string_ref payload;
+};
+
+// the transition data, mapped read-only: a header, the raw bytes of the signers, guids, sighashes and
+// payloads, then a table of blocks and a table of transactions that refer to those bytes by offset, and an
+// open-addressing index of the transactions by guid. A block index missing from the history has an empty
+// signer and no transactions. Written by convertTransitionFile on the host that reads it, so the integers
+// are in its byte order
+class TransitionData
+{
+public:
+    TransitionData(): header(nullptr), blockTable(nullptr), txTable(nullptr), guidIndex(nullptr), identity(0)
+    {
+    }
+
+    // a file written by an earlier version of convertTransitionFile, it is converted again when the text is there
+    static bool outdated(char const* path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        char magic[sizeof(MAGIC)];
+        return in.read(magic, sizeof(magic)) && std::memcmp(magic, MAGIC, sizeof(MAGIC) - 1) == 0 &&
+            magic[sizeof(MAGIC) - 1] < MAGIC[sizeof(MAGIC) - 1];
+    }
+
+    // false if there is no file, a file that doesn't hold together is an error
+    bool open(char const* path)
+    {
+        if (!std::ifstream(path).good())
+            return false;
+
+        boost::interprocess::file_mapping mapping(path, boost::interprocess::read_only);
+        boost::interprocess::mapped_region(mapping, boost::interprocess::read_only).swap(region);
+        std::uint64_t size = region.get_size();
+        char const* base = static_cast<char const*>(region.get_address());
+        if (size < sizeof(Header) || std::memcmp(base, MAGIC, sizeof(MAGIC)) != 0)
+            throw std::runtime_error("not a transition data file");
+
+        Header const* h = reinterpret_cast<Header const*>(base);
+        if (h->blockCount == 0 || !fits(h->blockTable, h->blockCount, sizeof(BlockRecord), size) || !fits(h->txTable, h->txCount, sizeof(TxRecord), size) ||
+            !fits(h->guidIndex, h->guidSlots, sizeof(GuidSlot), size) || h->guidSlots == 0 || (h->guidSlots & (h->guidSlots - 1)) != 0 ||
+            h->blockTable % alignof(BlockRecord) || h->txTable % alignof(TxRecord) || h->guidIndex % alignof(GuidSlot))
+        {
+            throw std::runtime_error("transition data tables out of bounds");
+        }
+        BlockRecord const* b = reinterpret_cast<BlockRecord const*>(base + h->blockTable);
+        TxRecord const* t = reinterpret_cast<TxRecord const*>(base + h->txTable);
+        GuidSlot const* g = reinterpret_cast<GuidSlot const*>(base + h->guidIndex);
+        for (std::uint64_t i = 0; i < h->blockCount; ++i)
+        {
+            if (!fits(b[i].signer, size) || b[i].firstTx > h->txCount || b[i].txCount > h->txCount - b[i].firstTx)
+                throw std::runtime_error("transition data block out of bounds");
+        }
+        for (std::uint64_t i = 0; i < h->txCount; ++i)
+        {
+            if (!fits(t[i].sighash, size) || !fits(t[i].guid, size) || !fits(t[i].payload, size))
+                throw std::runtime_error("transition data transaction out of bounds");
+        }
+        std::uint64_t taken = 0;
+        for (std::uint64_t i = 0; i < h->guidSlots; ++i)
+        {
+            if (g[i].block == EMPTY_SLOT)
+                continue;
+            if (g[i].block >= h->blockCount || g[i].txIdx >= b[g[i].block].txCount)
+                throw std::runtime_error("transition data guid index out of bounds");
+            ++taken;
+        }
+        if (taken == h->guidSlots)
+            throw std::runtime_error("transition data guid index is full");
+
+        header = h;
+        blockTable = b;
+        txTable = t;
+        guidIndex = g;
+        identity = fnv(fnv(fnv(FNV_BASIS, h, sizeof(Header)), b, sizeof(BlockRecord) * h->blockCount), g, sizeof(GuidSlot) * h->guidSlots);
+        return true;
+    }
+
+    // tells one history from another: the guid index holds every guid with the place of its transaction
+    std::uint64_t fingerprint() const
+    {
+        return identity;
+    }
+
+    // the block and the position in it of the transaction with guid
+    bool find(boost::string_ref guid, std::size_t* block, std::size_t* txIdx) const
+    {
+        if (!header)
+            return false;
+        std::uint64_t hash = guidHash(guid);
+        for (std::uint64_t slot = hash & (header->guidSlots - 1); guidIndex[slot].block != EMPTY_SLOT; slot = (slot + 1) & (header->guidSlots - 1))
+        {
+            GuidSlot const& entry = guidIndex[slot];
+            if (entry.hash == hash && tx(entry.block, entry.txIdx).guid == guid)
+            {
+                *block = entry.block;
+                *txIdx = entry.txIdx;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // FNV-1a, spelled out because the index is built ahead of time and has to hash the same everywhere
+    static std::uint64_t guidHash(boost::string_ref guid)
+    {
+        return fnv(FNV_BASIS, guid.data(), guid.size());
+    }
+
+    std::size_t size() const
+    {
+        return header ? static_cast<std::size_t>(header->blockCount) : 0;
+    }
+
+    boost::string_ref signer(std::size_t block) const
+    {
+        return ref(blockTable[block].signer);
+    }
+
+    std::size_t txCount(std::size_t block) const
+    {
+        return static_cast<std::size_t>(blockTable[block].txCount);
+    }
+
+    Tx tx(std::size_t block, std::size_t idx) const
+    {
+        TxRecord const& record = txTable[blockTable[block].firstTx + idx];
+        Tx ret;
+        ret.sighash = ref(record.sighash);
+        ret.guid = ref(record.guid);
+        ret.payload = ref(record.payload);
+        return ret;
+    }
+
+    struct Span
+    {
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    struct Header
+    {
+        char magic[8];
+        std::uint64_t blockCount;
+        std::uint64_t txCount;
+        std::uint64_t blockTable;
+        std::uint64_t txTable;
+        std::uint64_t guidIndex;
+        std::uint64_t guidSlots;
+    };
+
+    struct BlockRecord
+    {
+        Span signer;
+        std::uint64_t firstTx;
+        std::uint64_t txCount;
+    };
+
+    struct TxRecord
+    {
+        Span sighash;
+        Span guid;
+        Span payload;
+    };
+
+    // linear probing from the low bits of the hash, at most half of the slots are taken
+    struct GuidSlot
+    {
+        std::uint64_t hash;
+        std::uint32_t block;
+        std::uint32_t txIdx;
+    };
+
+    static const std::uint32_t EMPTY_SLOT = 0xffffffff;
+    static constexpr char MAGIC[8] = { 'C', 'C', 'T', 'R', 'A', 'N', 'S', '2' };
+
+private:
+    static const std::uint64_t FNV_BASIS = 14695981039346656037ull;
+
+    static std::uint64_t fnv(std::uint64_t hash, void const* data, std::uint64_t size)
+    {
+        for (std::uint64_t i = 0; i < size; ++i)
+        {
+            hash ^= static_cast<std::uint8_t const*>(data)[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    static bool fits(Span const& span, std::uint64_t size)
+    {
+        return span.offset <= size && span.size <= size - span.offset;
+    }
+
+    static bool fits(std::uint64_t offset, std::uint64_t count, std::uint64_t recordSize, std::uint64_t size)
+    {
+        return offset <= size && count <= (size - offset) / recordSize;
+    }
+
+    boost::string_ref ref(Span const& span) const
+    {
+        return boost::string_ref(static_cast<char const*>(region.get_address()) + span.offset, static_cast<std::size_t>(span.size));
+    }
+
+    boost::interprocess::mapped_region region;
+    Header const* header;
+    BlockRecord const* blockTable;
+    TxRecord const* txTable;
+    GuidSlot const* guidIndex;
+    std::uint64_t identity;
 };
 
-struct SimpleBlock
+constexpr char TransitionData::MAGIC[8];
+
+// what a transaction replayed ahead of its turn read from underneath its own writes
+struct ReadLog
 {
-    std::string signer;
-    std::vector<Tx> txs;
+    std::vector<std::string> addresses;
+    std::vector<std::string> prefixes;
 };
 
 struct Ctx
@@ -172,32 +419,215 @@ struct Ctx
     bool replaying;
     bool transitioning;
     std::map<std::string, std::string> currentState;
+    ReadLog* reads;
 
-    Ctx(): tip(0), replaying(false), transitioning(::transitioning)
+    Ctx(): tip(0), replaying(false), transitioning(::transitioning), reads(nullptr)
     {
     }
 };
 
-struct TxPos
+// an ordered map from address to state that is never changed in place: setting a key copies the path down to
+// it and shares the rest, so a copy of the map is a snapshot that costs nothing to take or to keep. A treap
+// with the hash of the key as priority, its shape only depends on what it holds
+class PersistentState
 {
-    int block;
-    int txIdx;
+    struct Node;
+    typedef std::shared_ptr<Node const> NodePtr;
+    // the nodes copied along a path share their entry with the ones they replace
+    typedef std::shared_ptr<std::pair<std::string, std::string> const> EntryPtr;
+
+    struct Node
+    {
+        EntryPtr entry;
+        std::size_t priority;
+        NodePtr left;
+        NodePtr right;
+    };
+
+public:
+    bool find(std::string const& key, std::string* value) const
+    {
+        Node const* node = lookup(key);
+        if (!node)
+            return false;
+        *value = node->entry->second;
+        return true;
+    }
+
+    void set(std::string const& key, std::string const& value)
+    {
+        EntryPtr entry = std::make_shared<std::pair<std::string, std::string> const>(key, value);
+        root = lookup(key) ? replace(root, entry) : insert(root, entry, std::hash<std::string>()(key));
+    }
+
+    // the state holding entries, which are in ascending key order without duplicates, built in linear time: the
+    // nodes go on a stack along the right spine of the tree, one with a higher priority takes the ones below it
+    // as its left subtree
+    static PersistentState fromSorted(std::vector<std::pair<std::string, std::string>>* entries)
+    {
+        std::vector<std::shared_ptr<Node>> spine;
+        for (auto& e : *entries)
+        {
+            std::size_t priority = std::hash<std::string>()(e.first);
+            auto node = std::make_shared<Node>(Node{ std::make_shared<std::pair<std::string, std::string> const>(std::move(e)), priority, NodePtr(), NodePtr() });
+            std::shared_ptr<Node> below;
+            while (!spine.empty() && spine.back()->priority < priority)
+            {
+                below = spine.back();
+                spine.pop_back();
+            }
+            node->left = below;
+            if (!spine.empty())
+                spine.back()->right = node;
+            spine.push_back(node);
+        }
+        entries->clear();
+        PersistentState ret;
+        if (!spine.empty())
+            ret.root = spine.front();
+        return ret;
+    }
+
+    // the entries in key order from the first key not less than from, over the snapshot it was made from
+    class Cursor
+    {
+    public:
+        Cursor(PersistentState const& state, std::string const& from) : root(state.root)
+        {
+            for (Node const* node = root.get(); node;)
+            {
+                if (node->entry->first < from)
+                {
+                    node = node->right.get();
+                }
+                else
+                {
+                    path.push_back(node);
+                    node = node->left.get();
+                }
+            }
+        }
+
+        bool valid() const
+        {
+            return !path.empty();
+        }
+
+        std::string const& key() const
+        {
+            return path.back()->entry->first;
+        }
+
+        std::string const& value() const
+        {
+            return path.back()->entry->second;
+        }
+
+        void next()
+        {
+            Node const* node = path.back();
+            path.pop_back();
+            for (node = node->right.get(); node; node = node->left.get())
+            {
+                path.push_back(node);
+            }
+        }
+
+    private:
+        NodePtr root;
+        std::vector<Node const*> path;
+    };
+
+private:
+    Node const* lookup(std::string const& key) const
+    {
+        Node const* node = root.get();
+        while (node && node->entry->first != key)
+        {
+            node = key < node->entry->first ? node->left.get() : node->right.get();
+        }
+        return node;
+    }
+
+    static NodePtr make(EntryPtr const& entry, std::size_t priority, NodePtr const& left, NodePtr const& right)
+    {
+        return std::make_shared<Node const>(Node{ entry, priority, left, right });
+    }
 
-    TxPos(): block(0), txIdx(0)
+    static NodePtr replace(NodePtr const& node, EntryPtr const& entry)
     {
+        std::string const& key = entry->first;
+        if (key < node->entry->first)
+            return make(node->entry, node->priority, replace(node->left, entry), node->right);
+        if (node->entry->first < key)
+            return make(node->entry, node->priority, node->left, replace(node->right, entry));
+        return make(entry, node->priority, node->left, node->right);
+    }
+
+    // the keys below key and the keys above it, key itself isn't in the tree
+    static void split(NodePtr const& node, std::string const& key, NodePtr* below, NodePtr* above)
+    {
+        if (!node)
+        {
+            below->reset();
+            above->reset();
+        }
+        else if (node->entry->first < key)
+        {
+            NodePtr right;
+            split(node->right, key, &right, above);
+            *below = make(node->entry, node->priority, node->left, right);
+        }
+        else
+        {
+            NodePtr left;
+            split(node->left, key, below, &left);
+            *above = make(node->entry, node->priority, left, node->right);
+        }
     }
 
-    TxPos(int b, int i): block(b), txIdx(i)
+    static NodePtr insert(NodePtr const& node, EntryPtr const& entry, std::size_t priority)
     {
+        if (!node || priority > node->priority)
+        {
+            NodePtr below, above;
+            split(node, entry->first, &below, &above);
+            return make(entry, priority, below, above);
+        }
+        if (entry->first < node->entry->first)
+            return make(node->entry, node->priority, insert(node->left, entry, priority), node->right);
+        return make(node->entry, node->priority, node->left, insert(node->right, entry, priority));
     }
+
+    NodePtr root;
 };
 
-static std::map<std::string, TxPos> txguid2prevblockidx;
-static std::vector<SimpleBlock> blocks;
+static TransitionData blocks;
 
+// replaying, the blocks replayed so far are in transitioningState, the transactions of the block being replayed
+// go on top of it in tipCurrentState and a transaction's own writes on top of that in Ctx::currentState; every
+// step keeps the changes of the layer it takes in, never the state underneath
 static std::mutex stateUpdateLock;
-static std::map<std::string, std::string> transitioningState;
+static PersistentState transitioningState;
 static std::map<std::string, std::string> tipCurrentState;
+
+// the state a restored checkpoint resumed the replay with and the block it resumed at, 0 for a replay from genesis
+static PersistentState restoredState;
+static int restoredBlockIdx;
+
+static void commitTransaction(std::map<std::string, std::string>* currentState)
+{
+    for (auto& e : *currentState)
+        tipCurrentState[e.first] = std::move(e.second);
+    currentState->clear();
+}
+
+static void commitBlock()
+{
+    for (auto const& e : tipCurrentState)
+        transitioningState.set(e.first, e.second);
+    tipCurrentState.clear();
+}
 static int updatedBlockIdx;
 static int updatedTxIdx;
 
@@ -206,13 +636,117 @@ static std::unique_ptr<std::thread> updatingSettings;
 static boost::multiprecision::cpp_int v2block;
 
 sawtooth::GlobalStateUPtr contextlessState;
+// contextlessState talks to the validator over a single socket, which can't be used from more than one thread at a
+// time: the scans page ahead on threads of their own and the settings are updated on another one
+static std::mutex contextlessStateLock;
 
 static int dealExpFixBlock = 278890;
 
+// the heights the Housekeeping changes below come into effect at. They change what Housekeeping writes, so
+// they are fixed here rather than read from the node's settings and stay off until a release sets them
+static const boost::multiprecision::cpp_int EXPIRY_INDEX_BLOCK = std::numeric_limits<std::uint64_t>::max();
+static const boost::multiprecision::cpp_int BOUNDED_HOUSEKEEPING_BLOCK = std::numeric_limits<std::uint64_t>::max();
+static const boost::multiprecision::cpp_int FEE_LEDGER_BLOCK = std::numeric_limits<std::uint64_t>::max();
+
+// verbs are dispatched through a table indexed by a perfect hash of the lowercased verb,
+// the seed is searched at compile time so adding a verb here can't introduce a collision
+static constexpr char const* VERBS[] = {
+    "SendFunds",
+    "RegisterAddress",
+    "RegisterTransfer",
+    "AddAskOrder",
+    "AddBidOrder",
+    "AddOffer",
+    "AddDealOrder",
+    "CompleteDealOrder",
+    "LockDealOrder",
+    "CloseDealOrder",
+    "Exempt",
+    "AddRepaymentOrder",
+    "CompleteRepaymentOrder",
+    "CloseRepaymentOrder",
+    "CollectCoins",
+    "Housekeeping"
+};
+static constexpr std::size_t VERB_COUNT = sizeof(VERBS) / sizeof(VERBS[0]);
+static constexpr int VERB_SLOT_BITS = 5;
+static constexpr std::size_t VERB_SLOT_COUNT = 1 << VERB_SLOT_BITS;
+static_assert(VERB_COUNT <= VERB_SLOT_COUNT, "not enough verb slots");
+
+static constexpr std::size_t verbLength(char const* verb)
+{
+    std::size_t len = 0;
+    while (verb[len])
+        ++len;
+    return len;
+}
+
+static constexpr std::size_t verbSlot(char const* verb, std::size_t len, std::uint32_t seed)
+{
+    // FNV-1a over the ASCII-lowercased verb, the top bits select the slot
+    std::uint32_t hash = seed;
+    for (std::size_t i = 0; i < len; ++i)
+    {
+        char c = verb[i];
+        if (c >= 'A' && c <= 'Z')
+            c = c - 'A' + 'a';
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash >> (32 - VERB_SLOT_BITS);
+}
+
+static constexpr bool isVerbSeedPerfect(std::uint32_t seed)
+{
+    bool used[VERB_SLOT_COUNT] = {};
+    for (std::size_t i = 0; i < VERB_COUNT; ++i)
+    {
+        std::size_t slot = verbSlot(VERBS[i], verbLength(VERBS[i]), seed);
+        if (used[slot])
+            return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+static constexpr std::uint32_t findVerbSeed()
+{
+    std::uint32_t seed = 2166136261u;
+    while (!isVerbSeedPerfect(seed))
+        ++seed;
+    return seed;
+}
+
+static constexpr std::uint32_t VERB_SEED = findVerbSeed();
+
+struct VerbStats
+{
+    std::atomic<std::uint64_t> invocations;
+    std::atomic<std::uint64_t> failures;
+    std::atomic<std::uint64_t> microseconds;
+};
+
+static VerbStats verbStats[VERB_SLOT_COUNT];
+
+static void logVerbStats()
+{
+    std::stringstream stats;
+    stats << "Verb statistics (invocations/failures/microseconds):";
+    for (std::size_t i = 0; i < VERB_COUNT; ++i)
+    {
+        VerbStats const& s = verbStats[verbSlot(VERBS[i], verbLength(VERBS[i]), VERB_SEED)];
+        stats << " " << VERBS[i] << "=" << s.invocations.load() << "/" << s.failures.load() << "/" << s.microseconds.load();
+    }
+    LOG4CXX_INFO(logger, stats.str());
+}
+
 #if IS_LINUX
 char const* const transitionFile = "/home/Creditcoin/cctt/data/transition.txt";
+char const* const transitionDataFile = "/home/Creditcoin/cctt/data/transition.bin";
+char const* const transitionCheckpointFile = "/home/Creditcoin/cctt/data/transition.ckpt";
 #else
 char const* const transitionFile = "C:\\transition.txt";
+char const* const transitionDataFile = "C:\\transition.bin";
+char const* const transitionCheckpointFile = "C:\\transition.ckpt";
 #endif
 
 static void usage(int exitCode = 1)
@@ -220,6 +754,22 @@ static void usage(int exitCode = 1)
     std::cout << "Usage:" << std::endl;
     std::cout << "processor [connect_string]" << std::endl;
     std::cout << "    connect_string - connect string to validator in format tcp://host:port" << std::endl;
+    std::cout << "processor -convertTransition" << std::endl;
+    std::cout << "    converts " << transitionFile << " to " << transitionDataFile << " and exits" << std::endl;
+    std::cout << "processor -benchExpiryIndex" << std::endl;
+    std::cout << "    times a Housekeeping over a million deal orders with and without the expiry index and exits" << std::endl;
+    std::cout << "processor -verifyReplay" << std::endl;
+    std::cout << "    replays " << transitionDataFile << " in turn and ahead of turn, compares the results and exits" << std::endl;
+    std::cout << "processor -verifyInterest" << std::endl;
+    std::cout << "    compares the compound interest of repayments with a loop over every tick and exits" << std::endl;
+    std::cout << "processor -verifyPayloads" << std::endl;
+    std::cout << "    compares the decoding of random transaction payloads with nlohmann::json and exits" << std::endl;
+    std::cout << "processor -verifyAmounts" << std::endl;
+    std::cout << "    compares the arithmetic of wallet balances with cpp_int and exits" << std::endl;
+    std::cout << "processor -verifyParams" << std::endl;
+    std::cout << "    compares the decoding of random verb parameters with the parsing before the schemas and exits" << std::endl;
+    std::cout << "processor -verifyRewards" << std::endl;
+    std::cout << "    compares block rewards summed per wallet with rewarding every block on its own and exits" << std::endl;
     exit(exitCode);
 }
 
@@ -382,1512 +932,4309 @@ static std::vector<std::uint8_t> toVector(std::string const& in)
     return out;
 }
 
-// filter should paginate
-static void filter(Ctx const& ctx, std::string const& prefix, std::function<void(std::string const&, std::string const&)> const& lister)
+// the entries under a prefix in address order, from start on when one is given. The pages come from the validator
+// on a thread of their own that stays at most PREFIX_SCAN_PAGES_AHEAD pages ahead of the loop, so the next round
+// trip overlaps the work on the current page, and leaving the loop early stops the fetching. While transitioning
+// the replayed state is listed instead
+class PrefixScan
 {
-    //no pagination needed!?
-    if (ctx.transitioning)
+public:
+    typedef sawtooth::GlobalState::KeyValue Entry;
+
+    class iterator
     {
-        auto currentState = ctx.currentState;
-        currentState.insert(tipCurrentState.begin(), tipCurrentState.end());
-        for (auto& e: transitioningState)
+    public:
+        explicit iterator(PrefixScan* scan) : scan(scan)
         {
-            auto updated = currentState.find(e.first);
-            if (updated == currentState.end())
+        }
+
+        Entry const& operator*() const
+        {
+            return scan->page[scan->position];
+        }
+
+        Entry const* operator->() const
+        {
+            return &scan->page[scan->position];
+        }
+
+        iterator& operator++()
+        {
+            if (!scan->advance())
             {
-                if (e.first.rfind(prefix, 0) == 0 && e.second.size() > 0)
-                    lister(e.first, e.second);
+                scan = nullptr;
             }
+            return *this;
         }
-        for (auto& e: currentState)
+
+        bool operator==(iterator const& other) const
         {
-            if (e.first.rfind(prefix, 0) == 0 && e.second.size() > 0)
-                lister(e.first, e.second);
+            return scan == other.scan;
         }
 
-        return;
-    }
+        bool operator!=(iterator const& other) const
+        {
+            return scan != other.scan;
+        }
 
+    private:
+        PrefixScan* scan;
+    };
 
-    std::string root;
-    std::string start;
-    try
+    PrefixScan(Ctx const& ctx, std::string const& prefix, std::string const& start = std::string())
+        : position(0), finished(false), stopped(false)
     {
-        do
+        if (!ctx.transitioning)
         {
-            std::vector<sawtooth::GlobalState::KeyValue> states_paginated_slice;
-            contextlessState->GetStatesByPrefix(prefix, &root, &start, &states_paginated_slice);
+            fetcher = std::thread(&PrefixScan::fetch, this, prefix, start);
+            return;
+        }
+
+        if (ctx.reads)
+        {
+            ctx.reads->prefixes.push_back(prefix);
+        }
 
-            // don't rely on vector length, the vector holds a paginated subset only.
-            for (auto& state : states_paginated_slice)
+        // the changes of the transaction shadow those of the block, both are copied as they are when the scan
+        // starts; the replayed state underneath is a snapshot merged in as the scan goes
+        std::map<std::string, std::string> const* layers[] = { &ctx.currentState, &tipCurrentState };
+        for (auto layer : layers)
+        {
+            for (auto i = layer->lower_bound(std::max(prefix, start)); i != layer->end() && i->first.rfind(prefix, 0) == 0; ++i)
             {
-                std::string address = state.first;
-                std::string protobuf = state.second;
-                lister(address, protobuf);
+                changes.insert(*i);
             }
-
-        } while (!start.empty());
-    }
-    catch (sawtooth::InvalidTransaction const&)
-    {
-        throw;
-    }
-    catch (std::exception const& e)
-    {
-        //make it throw on purpose to test logs
-        LOG4CXX_DEBUG(logger, "filter op failed");
-        throw sawtooth::InvalidTransaction(e.what());
+        }
+        change = changes.begin();
+        replayed.reset(new PersistentState::Cursor(transitioningState, std::max(prefix, start)));
+        replayedPrefix = prefix;
+        finished = true;
     }
-}
 
-static boost::multiprecision::cpp_int getBigint(std::string const& bigint, bool allowNegative = false)
-{
-    boost::multiprecision::cpp_int ret;
-    try
-    {
-        ret = boost::multiprecision::cpp_int(bigint);
-    }
-    catch (std::runtime_error const&)
-    {
-        throw sawtooth::InvalidTransaction("Invalid number format");
-    }
-    if (!allowNegative && ret < 0)
+    ~PrefixScan()
     {
-        throw sawtooth::InvalidTransaction("Expecting a positive value");
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopped = true;
+        }
+        changed.notify_all();
+        if (fetcher.joinable())
+        {
+            fetcher.join();
+        }
     }
-    return ret;
-}
 
-static std::string trimQuotes(std::string const& quotedStr)
-{
-    auto quotedStrLen = quotedStr.length();
-    assert(quotedStr[0] == '"' && quotedStr[quotedStrLen - 1] == '"');
-    return quotedStr.substr(1, quotedStrLen - 2);
-}
+    PrefixScan(PrefixScan const&) = delete;
+    PrefixScan& operator=(PrefixScan const&) = delete;
 
-static std::string getParam(nlohmann::json const& query, std::string const& id, std::string const& name)
-{
-    auto param = query.find(id);
-    if (param == query.end())
+    // a scan is gone through once, begin() waits for the first page
+    iterator begin()
     {
-        throw sawtooth::InvalidTransaction("Expecting " + name);
+        return iterator(advance() ? this : nullptr);
     }
-    return param->dump();
-}
-
-static std::string getString(nlohmann::json const& query, std::string const& id, std::string const& name)
-{
-    return trimQuotes(getParam(query, id, name));
-}
 
-static std::string getBigint(nlohmann::json const& query, std::string const& id, std::string const& name, boost::multiprecision::cpp_int* value = 0)
-{
-    std::string bigint = getString(query, id, name);
-    boost::multiprecision::cpp_int result = getBigint(bigint);
-    if (value)
+    iterator end()
     {
-        *value = result;
+        return iterator(nullptr);
     }
-    return bigint;
-}
 
-static void doUpdateSettings()
-{
-    try
+private:
+    // the scan starts at the first entry not before start; paging can only start at an address that exists, when
+    // the validator turns start down the prefix is paged from its first entry and what comes before start is dropped
+    void fetch(std::string prefix, std::string start)
     {
-        assert(!transitioning);
-
-        std::unique_ptr<std::map<std::string, std::string>> newSettings(new std::map<std::string, std::string>());
-        filter(Ctx(), SETTINGS_NAMESPACE, [&newSettings](std::string const& address, std::string const& protobuf) {
-            Setting setting;
-            setting.ParseFromString(protobuf);
-            for (auto& entry : setting.entries())
+        std::exception_ptr error;
+        try
+        {
+            std::string root;
+            std::string from;
+            do
             {
-                (*newSettings)[entry.key()] = entry.value();
-            }
-        });
+                std::vector<Entry> states_paginated_slice;
+                try
+                {
+                    std::lock_guard<std::mutex> guard(contextlessStateLock);
+                    contextlessState->GetStatesByPrefix(prefix, &root, &start, &states_paginated_slice);
+                }
+                catch (std::exception const& e)
+                {
+                    if (start.empty() || !from.empty() || !root.empty())
+                    {
+                        throw;
+                    }
+                    LOG4CXX_DEBUG(logger, "paging from " << start << " failed, paging from the prefix: " << e.what());
+                    from = start;
+                    start.clear();
+                    std::lock_guard<std::mutex> guard(contextlessStateLock);
+                    contextlessState->GetStatesByPrefix(prefix, &root, &start, &states_paginated_slice);
+                }
+                if (!from.empty())
+                {
+                    auto first = std::lower_bound(states_paginated_slice.begin(), states_paginated_slice.end(), from,
+                        [](Entry const& entry, std::string const& key) { return entry.first < key; });
+                    states_paginated_slice.erase(states_paginated_slice.begin(), first);
+                }
+
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [this] { return stopped || pages.size() < PREFIX_SCAN_PAGES_AHEAD; });
+                if (stopped)
+                {
+                    return;
+                }
+                pages.push_back(std::move(states_paginated_slice));
+                changed.notify_all();
+            } while (!start.empty());
+        }
+        catch (sawtooth::InvalidTransaction const&)
         {
-            //nothrow segment:
-            auto updatedSettings = newSettings.release();
-            auto oldSettings = settings.exchange(updatedSettings);
-            delete oldSettings; //dtor of the map shouldn't throw as it only uses std::strings
+            error = std::current_exception();
+        }
+        catch (std::exception const& e)
+        {
+            LOG4CXX_DEBUG(logger, "filter op failed");
+            error = std::make_exception_ptr(sawtooth::InvalidTransaction(e.what()));
+        }
+        catch (...)
+        {
+            error = std::current_exception();
         }
 
-        auto actualSettings = settings.load();
-        auto i = actualSettings->find("sawtooth.validator.gateway");
-        if (i != actualSettings->end())
         {
-            std::unique_ptr<std::string> address(new std::string(i->second));
-            if (address->find("tcp://") != 0)
-            {
-                *address = "tcp://" + *address;
-            }
-            delete externalGatewayAddress.exchange(address.release());
+            std::lock_guard<std::mutex> guard(lock);
+            failure = error;
+            finished = true;
         }
-        i = actualSettings->find("creditcoin.v2block");
-        if (i != actualSettings->end())
+        changed.notify_all();
+    }
+
+    // moves to the next entry, false past the last one; a failed fetch is thrown once the pages before it are done
+    bool advance()
+    {
+        if (replayed)
         {
-            v2block = getBigint(i->second);
+            return merge();
+        }
+        if (!page.empty() && ++position < page.size())
+        {
+            return true;
+        }
+        for (;;)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this] { return finished || !pages.empty(); });
+            if (pages.empty())
+            {
+                if (failure)
+                {
+                    std::rethrow_exception(failure);
+                }
+                page.clear();
+                return false;
+            }
+            page = std::move(pages.front());
+            pages.pop_front();
+            position = 0;
+            changed.notify_all();
+            if (!page.empty())
+            {
+                return true;
+            }
         }
     }
-    catch (...)
+
+    // the next entry of the replayed state with the changes on top, deleted ones are skipped
+    bool merge()
     {
+        for (;;)
+        {
+            bool fromReplayed = replayed->valid() && replayed->key().rfind(replayedPrefix, 0) == 0;
+            if (!fromReplayed && change == changes.end())
+            {
+                return false;
+            }
+            Entry entry;
+            if (change != changes.end() && (!fromReplayed || change->first <= replayed->key()))
+            {
+                if (fromReplayed && change->first == replayed->key())
+                {
+                    replayed->next();
+                }
+                entry = *change++;
+            }
+            else
+            {
+                entry = Entry(replayed->key(), replayed->value());
+                replayed->next();
+            }
+            if (entry.second.size() > 0)
+            {
+                page.assign(1, std::move(entry));
+                position = 0;
+                return true;
+            }
+        }
     }
-}
 
-static void cleanupTransitioning()
-{
-    std::this_thread::sleep_for(60s);
-    std::remove(transitionFile);
-    exit(0);
-}
+    std::vector<Entry> page;
+    std::size_t position;
+    std::map<std::string, std::string> changes;
+    std::map<std::string, std::string>::const_iterator change;
+    std::unique_ptr<PersistentState::Cursor> replayed;
+    std::string replayedPrefix;
+    std::deque<std::vector<Entry>> pages;
+    bool finished;
+    bool stopped;
+    std::exception_ptr failure;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread fetcher;
+};
 
-static void killer()
+// runs the iterations of a loop on all the cores, the calling thread included, for work that only reads what it
+// shares; the iterations must not throw
+class WorkerPool
 {
-    for (;;)
+public:
+    explicit WorkerPool(unsigned workers) : work(nullptr), count(0), next(0), busy(0), generation(0), stopped(false)
     {
-        std::this_thread::sleep_for(60s);
-        auto now = std::chrono::system_clock::now();
-        bool idle;
+        for (unsigned i = 0; i < workers; ++i)
         {
-            std::lock_guard<std::mutex> guard(killerLock);
-            idle = lastTime + 300s < now;
+            threads.emplace_back(&WorkerPool::serve, this);
         }
-        if (idle)
-            cleanupTransitioning();
     }
-}
 
-static void updateSettings()
-{
-    // this is a thread routine, we don't join the thread and don't care if it's in progress when the process termitates, just terminating it is ok
-    for (;;)
+    ~WorkerPool()
     {
-        std::this_thread::sleep_for(6s);
-        doUpdateSettings();
-        std::this_thread::sleep_for(6000s);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopped = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
     }
-}
 
-static std::string sha512(const std::string& message)
-{
-    std::string digest;
-    CryptoPP::SHA512 hash;
+    WorkerPool(WorkerPool const&) = delete;
+    WorkerPool& operator=(WorkerPool const&) = delete;
 
-    CryptoPP::StringSource hasher(
-        message,
-        true,
-        new CryptoPP::HashFilter(
-            hash,
-            new CryptoPP::HexEncoder(
-                new CryptoPP::StringSink(digest),
-                false)));
+    // the threads besides the caller's
+    std::size_t workers() const
+    {
+        return threads.size();
+    }
 
-    return digest;
-}
+    // calls job(i) for every i below n and returns once all of them are done
+    void run(std::size_t n, std::function<void(std::size_t)> const& job)
+    {
+        if (n < 2 || threads.empty())
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                job(i);
+            }
+            return;
+        }
 
-static std::string sha512id(const std::string& message)
-{
-    std::string ret = sha512(message).substr(SKIP_TO_GET_60, std::string::npos);
-    assert(ret.length() == MERKLE_ADDRESS_LENGTH - NAMESPACE_PREFIX_LENGTH - PREFIX_LENGTH);
-    return ret;
-}
+        std::lock_guard<std::mutex> exclusive(running);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            work = &job;
+            count = n;
+            next = 0;
+            busy = threads.size();
+            ++generation;
+        }
+        wake.notify_all();
+        drain();
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this] { return busy == 0; });
+        work = nullptr;
+    }
 
-static std::string mapNamespace(std::string const& namespaceString)
-{
-    std::string ns = sha512(namespaceString);
-    return ns.substr(0, NAMESPACE_PREFIX_LENGTH);
-}
+private:
+    void serve()
+    {
+        std::size_t seen = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [this, seen] { return stopped || generation != seen; });
+                if (stopped)
+                {
+                    return;
+                }
+                seen = generation;
+            }
+            drain();
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (--busy == 0)
+                {
+                    done.notify_all();
+                }
+            }
+        }
+    }
 
-static std::string namespacePrefix = mapNamespace(NAMESPACE);
+    void drain()
+    {
+        for (std::size_t i = next++; i < count; i = next++)
+        {
+            (*work)(i);
+        }
+    }
 
-static bool isHex(const std::string& str)
-{
-    return str.find_first_not_of("0123456789abcdef") == std::string::npos;
-}
+    std::function<void(std::size_t)> const* work;
+    std::size_t count;
+    std::atomic<std::size_t> next;
+    std::size_t busy;
+    std::size_t generation;
+    bool stopped;
+    std::mutex running;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::vector<std::thread> threads;
+};
 
-static std::string makeAddress(std::string const& prefix, std::string const& key)
+static WorkerPool& workerPool()
 {
-    std::string id = sha512id(key);
-    std::string addr = namespacePrefix + prefix + id;
-    assert(addr.length() == MERKLE_ADDRESS_LENGTH);
-    return addr;
+    static WorkerPool pool(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+    return pool;
 }
 
-static std::string encodeBase64(std::vector<std::uint8_t> const& in)
+static boost::multiprecision::cpp_int getBigint(std::string const& bigint, bool allowNegative = false)
 {
-    std::stringstream out;
-
-    unsigned int val = 0;
-    int valb = -6;
-    for (unsigned char c : in)
+    boost::multiprecision::cpp_int ret;
+    try
     {
-        val = (val << 8) + c;
-        valb += 8;
-        while (valb >= 0)
-        {
-            out << (base64lookupString[(val >> valb) & 0x3F]);
-            valb -= 6;
-        }
+        ret = boost::multiprecision::cpp_int(bigint);
     }
-    if (valb > -6)
+    catch (std::runtime_error const&)
     {
-        out << (base64lookupString[((val << 8) >> (valb + 8)) & 0x3F]);
+        throw sawtooth::InvalidTransaction("Invalid number format");
     }
-    for (int i = 0, rest = in.size() % 3; i < rest; ++i)
+    if (!allowNegative && ret < 0)
     {
-        out << '=';
+        throw sawtooth::InvalidTransaction("Expecting a positive value");
     }
-    return out.str();
+    return ret;
 }
 
-static std::string toString(std::vector<std::uint8_t> const& v)
+static std::string trimQuotes(std::string const& quotedStr)
 {
-    const char* data = reinterpret_cast<const char*>(v.data());
-    std::string out(data, data + v.size());
-    return out;
+    auto quotedStrLen = quotedStr.length();
+    assert(quotedStr[0] == '"' && quotedStr[quotedStrLen - 1] == '"');
+    return quotedStr.substr(1, quotedStrLen - 2);
 }
 
-static ::google::protobuf::uint64 parseUint64(std::string const& numberString) {
-    ::google::protobuf::uint64 number;
-    std::istringstream iss(numberString);
-    iss >> number;
-    if (iss.fail() || !iss.eof())
-    {
-        throw sawtooth::InvalidTransaction("Invalid number");
-    }
-    return number;
-}
+static const int PARAM_COUNT = 6;
+static char const* const PARAM_KEYS[PARAM_COUNT] = { "p1", "p2", "p3", "p4", "p5", "p6" };
 
-static std::string getStringLower(nlohmann::json const& query, std::string const& id, std::string const& name)
+// positional parameters p1..p6 of a transaction, values refer directly to the payload bytes
+// unless they had to be escaped or rendered from a non-text item, then they refer to storage
+struct Params
 {
-    std::string ret = getString(query, id, name);
-    boost::to_lower(ret);
-    return ret;
-}
+    boost::string_ref values[PARAM_COUNT];
+    bool present[PARAM_COUNT];
+    std::string storage[PARAM_COUNT];
 
-static ::google::protobuf::uint64 getUint64(nlohmann::json const& query, std::string const& id, std::string const& name)
-{
-    return parseUint64(getString(query, id, name));
-}
+    Params(): present()
+    {
+    }
 
-static std::string toString(boost::multiprecision::cpp_int const& bigint)
-{
-    std::stringstream ss;
-    ss << bigint;
-    return ss.str();
-}
+    Params(Params const&) = delete;
+    Params& operator=(Params const&) = delete;
+};
 
-static std::string compress(std::string const& uncompressed)
+// reads the payload CBOR in place, accepting exactly what nlohmann::json::from_cbor accepts
+class CborReader
 {
-    // uncompressed key is 0x04 + x + y, where x and y are 32 bytes each
-    // to compress we use 0x02 + x if y is even or 0x03 + x if y is odd
+public:
+    // thrown for anything from_cbor would not accept, the caller decides how to report it
+    struct Malformed
+    {
+    };
 
-    std::string ret;
+    CborReader(std::uint8_t const* data, std::size_t size): pos(data), end(data + size)
+    {
+    }
 
-    std::string marker = uncompressed.substr(0, 2);
-    if (uncompressed.length() == 2 * (1 + 2 * 32) && isHex(uncompressed) && marker == "04")
+    bool atMap() const
     {
-        std::string x = uncompressed.substr(2 * 1, 2 * 32);
-        std::string yLast = uncompressed.substr(2 * (1 + 32 + 31), 2 * 1);
+        return pos < end && ((*pos >= 0xa0 && *pos <= 0xbb) || *pos == 0xbf);
+    }
 
-        std::istringstream iss(yLast);
-        unsigned int last;
-        iss >> std::hex >> last;
-        if (!iss.fail() && iss.eof())
-        {
-            if (last % 2)
-            {
-                ret = "03" + x;
-            }
-            else
-            {
-                ret = "02" + x;
-            }
-        }
+    bool atText() const
+    {
+        return pos < end && ((*pos >= 0x60 && *pos <= 0x7b) || *pos == 0x7f);
     }
-    else if ((marker == "02" || marker == "03") && uncompressed.length() == 66)
+
+    // returns the number of entries, an indefinite length map ends with a break instead
+    std::uint64_t readMapHeader(bool* indefinite)
     {
-        return uncompressed;
+        std::uint8_t initial = next();
+        *indefinite = initial == 0xbf;
+        if (*indefinite)
+            return 0;
+        return readLength(initial, 0xa0);
     }
 
-    if (!ret.length())
+    bool atBreak()
     {
-        throw sawtooth::InvalidTransaction("Unexpected public key format");
+        require(1);
+        if (*pos != 0xff)
+            return false;
+        ++pos;
+        return true;
     }
 
-    return ret;
-}
+    // a definite text is returned in place, an indefinite one is concatenated into scratch
+    boost::string_ref readText(std::string* scratch)
+    {
+        std::uint8_t initial = next();
+        if (initial == 0x7f)
+        {
+            scratch->clear();
+            appendChunks(scratch);
+            return boost::string_ref(*scratch);
+        }
+        if (initial < 0x60 || initial > 0x7b)
+            fail();
+        std::uint64_t len = readLength(initial, 0x60);
+        require(len);
+        boost::string_ref text(reinterpret_cast<char const*>(pos), static_cast<std::size_t>(len));
+        pos += len;
+        return text;
+    }
 
-static std::string getFromHeader(nlohmann::json const& block, char const* fieldName)
-{
-    if (block.count(HEADER) != 1)
+    void skip()
     {
-        throw sawtooth::InvalidTransaction(RPC_FAILURE);
+        std::uint8_t initial = next();
+        std::uint8_t major = initial >> 5;
+        std::uint8_t info = initial & 0x1f;
+        switch (major)
+        {
+        case 0:
+        case 1:
+            readLength(initial, initial & 0xe0);
+            break;
+        case 3:
+        {
+            --pos;
+            std::string scratch;
+            readText(&scratch);
+            break;
+        }
+        case 4:
+            if (info == 0x1f)
+            {
+                while (!atBreak())
+                    skip();
+            }
+            else
+            {
+                for (std::uint64_t i = readLength(initial, 0x80); i > 0; --i)
+                    skip();
+            }
+            break;
+        case 5:
+            if (info == 0x1f)
+            {
+                while (!atBreak())
+                    skipEntry();
+            }
+            else
+            {
+                for (std::uint64_t i = readLength(initial, 0xa0); i > 0; --i)
+                    skipEntry();
+            }
+            break;
+        case 7:
+            switch (initial)
+            {
+            case 0xf4:
+            case 0xf5:
+            case 0xf6:
+                break;
+            case 0xf9:
+                advance(2);
+                break;
+            case 0xfa:
+                advance(4);
+                break;
+            case 0xfb:
+                advance(8);
+                break;
+            default:
+                fail();
+            }
+            break;
+        default:
+            // byte strings and tags are not supported
+            fail();
+        }
     }
-    auto& header = block[HEADER];
-    if (!header.is_object())
+
+    void skipEntry()
     {
-        throw sawtooth::InvalidTransaction(RPC_FAILURE);
+        if (!atText())
+            fail();
+        skip();
+        skip();
     }
-    return header[fieldName];
-}
 
-static std::string blockNum(nlohmann::json const& block)
+private:
+    static void fail()
+    {
+        throw Malformed();
+    }
+
+    void require(std::uint64_t len) const
+    {
+        if (len > static_cast<std::uint64_t>(end - pos))
+            fail();
+    }
+
+    void advance(std::uint64_t len)
+    {
+        require(len);
+        pos += len;
+    }
+
+    std::uint8_t next()
+    {
+        require(1);
+        return *pos++;
+    }
+
+    std::uint64_t readLength(std::uint8_t initial, std::uint8_t base)
+    {
+        std::uint8_t info = initial - base;
+        if (info < 24)
+            return info;
+        int bytes;
+        switch (info)
+        {
+        case 24:
+            bytes = 1;
+            break;
+        case 25:
+            bytes = 2;
+            break;
+        case 26:
+            bytes = 4;
+            break;
+        case 27:
+            bytes = 8;
+            break;
+        default:
+            fail();
+        }
+        require(bytes);
+        std::uint64_t len = 0;
+        for (int i = 0; i < bytes; ++i)
+            len = (len << 8) | *pos++;
+        return len;
+    }
+
+    void appendChunks(std::string* out)
+    {
+        while (!atBreak())
+        {
+            if (!atText())
+                fail();
+            std::string nested;
+            boost::string_ref chunk = readText(&nested);
+            out->append(chunk.data(), chunk.size());
+        }
+    }
+
+    std::uint8_t const* pos;
+    std::uint8_t const* end;
+};
+
+static bool needsEscaping(boost::string_ref text)
 {
-    std::string num = getFromHeader(block, BLOCK_NUM);
-    return num;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\' || (c >= 0 && c < 0x20))
+            return true;
+    }
+    return false;
 }
 
-static boost::multiprecision::cpp_int blockNumInt(nlohmann::json const& block)
+// escapes a string the way nlohmann::json::dump does
+static void escape(boost::string_ref text, std::string* out)
 {
-    std::string num = blockNum(block);
-    return getBigint(num);
+    static const char hexify[] = "0123456789abcdef";
+    out->clear();
+    for (char c : text)
+    {
+        switch (c)
+        {
+        case '"':
+            out->append("\\\"");
+            break;
+        case '\\':
+            out->append("\\\\");
+            break;
+        case '\b':
+            out->append("\\b");
+            break;
+        case '\f':
+            out->append("\\f");
+            break;
+        case '\n':
+            out->append("\\n");
+            break;
+        case '\r':
+            out->append("\\r");
+            break;
+        case '\t':
+            out->append("\\t");
+            break;
+        default:
+            if (c >= 0 && c < 0x20)
+            {
+                out->append("\\u00");
+                out->push_back(hexify[c >> 4]);
+                out->push_back(hexify[c & 0x0f]);
+            }
+            else
+            {
+                out->push_back(c);
+            }
+        }
+    }
 }
 
-boost::multiprecision::cpp_int calcInterest(boost::multiprecision::cpp_int const& amount, boost::multiprecision::cpp_int const& ticks, boost::multiprecision::cpp_int const& interest)
+static boost::string_ref getParam(Params const& query, int idx, char const* name)
 {
-    boost::multiprecision::cpp_int total = amount;
-    for (boost::multiprecision::cpp_int i = 0; i < ticks; ++i)
+    if (!query.present[idx - 1])
     {
-        boost::multiprecision::cpp_int compound = (total * interest) / INTEREST_MULTIPLIER;
-        total += compound;
+        throw sawtooth::InvalidTransaction(std::string("Expecting ") + name);
     }
-    return total;
+    return query.values[idx - 1];
 }
 
-class Applicator : public sawtooth::TransactionApplicator
+static void doUpdateSettings()
 {
-public:
-    Applicator(sawtooth::TransactionUPtr txn, sawtooth::GlobalStateUPtr state) :
-        TransactionApplicator(std::move(txn), std::move(state))
+    try
     {
-    };
+        assert(!transitioning);
 
-    void Apply(std::string const& cmd, nlohmann::json const& query)
-    {
-        if (v2block != 0 && lastBlockInt(ctx) > v2block)
-        {
-            std::string const& version = txn->header()->GetValue(sawtooth::TransactionHeaderField::TransactionHeaderFamilyVersion);
-            if (version[0] == '1')
-                throw sawtooth::InvalidTransaction("Version 1 transactions are not accepted after 2.0");
-        }
-#ifndef NDEBUG
-        {
-            //std::ofstream log("B:\\Job\\gluwa\\prod\\transition.log", std::ios::app);
-            //std::stringstream l;
-            //l << ctx.tip << ": " << ctx.guid << " - " << cmd << "\n";
-            //for (int i = 1; ; ++i)
-            //{
-            //    std::stringstream p;
-            //    p << "p" << i;
-            //    auto pp = p.str();
-            //    auto param = query.find(pp);
-            //    if (param == query.end())
-            //        break;
-            //    l << " " << param->dump();
-            //}
-            //auto ll = l.str();
-            //log << ll;
-            //OutputDebugStringA((ll.c_str());
-        }
-#endif
-        if (boost::iequals(cmd, "SendFunds"))
-        {
-            SendFunds(query);
-        }
-        else if (boost::iequals(cmd, "RegisterAddress"))
-        {
-            RegisterAddress(query);
-        }
-        else if (boost::iequals(cmd, "RegisterTransfer"))
-        {
-            RegisterTransfer(query);
-        }
-        else if (boost::iequals(cmd, "AddAskOrder"))
-        {
-            AddAskOrder(query);
-        }
-        else if (boost::iequals(cmd, "AddBidOrder"))
-        {
-            AddBidOrder(query);
-        }
-        else if (boost::iequals(cmd, "AddOffer"))
-        {
-            AddOffer(query);
-        }
-        else if (boost::iequals(cmd, "AddDealOrder"))
-        {
-            AddDealOrder(query);
-        }
-        else if (boost::iequals(cmd, "CompleteDealOrder"))
-        {
-            CompleteDealOrder(query);
-        }
-        else if (boost::iequals(cmd, "LockDealOrder"))
-        {
-            LockDealOrder(query);
-        }
-        else if (boost::iequals(cmd, "CloseDealOrder"))
-        {
-            CloseDealOrder(query);
-        }
-        else if (boost::iequals(cmd, "Exempt"))
-        {
-            Exempt(query);
-        }
-        else if (boost::iequals(cmd, "AddRepaymentOrder"))
+        std::unique_ptr<std::map<std::string, std::string>> newSettings(new std::map<std::string, std::string>());
+        for (auto const& state : PrefixScan(Ctx(), SETTINGS_NAMESPACE))
         {
-            AddRepaymentOrder(query);
+            Setting setting;
+            setting.ParseFromString(state.second);
+            for (auto& entry : setting.entries())
+            {
+                (*newSettings)[entry.key()] = entry.value();
+            }
         }
-        else if (boost::iequals(cmd, "CompleteRepaymentOrder"))
         {
-            CompleteRepaymentOrder(query);
+            //nothrow segment:
+            auto updatedSettings = newSettings.release();
+            auto oldSettings = settings.exchange(updatedSettings);
+            delete oldSettings; //dtor of the map shouldn't throw as it only uses std::strings
         }
-        else if (boost::iequals(cmd, "CloseRepaymentOrder"))
+
+        auto actualSettings = settings.load();
+        auto i = actualSettings->find("sawtooth.validator.gateway");
+        if (i != actualSettings->end())
         {
-            CloseRepaymentOrder(query);
+            std::unique_ptr<std::string> address(new std::string(i->second));
+            if (address->find("tcp://") != 0)
+            {
+                *address = "tcp://" + *address;
+            }
+            delete externalGatewayAddress.exchange(address.release());
         }
-        else if (boost::iequals(cmd, "CollectCoins"))
+        i = actualSettings->find("creditcoin.v2block");
+        if (i != actualSettings->end())
         {
-            CollectCoins(query);
+            v2block = getBigint(i->second);
         }
-        else if (boost::iequals(cmd, "Housekeeping"))
-        {
-            Housekeeping(query);
+    }
+    catch (...)
+    {
+    }
+}
+
+static void stopCheckpointing();
+
+static void cleanupTransitioning()
+{
+    std::this_thread::sleep_for(60s);
+    stopCheckpointing();
+    logVerbStats();
+    std::remove(transitionFile);
+    std::remove(transitionDataFile);
+    std::remove(transitionCheckpointFile);
+    exit(0);
+}
+
+// a checkpoint of a replay: the magic, the fingerprint of the transition data it was taken from, the block to
+// replay next, the number of entries and then each address and its state prefixed with their sizes. Deleted
+// entries are left out, nothing is underneath the replayed state for them to shadow
+static const char CHECKPOINT_MAGIC[8] = { 'C', 'C', 'C', 'K', 'P', 'T', '0', '1' };
+
+// at most one checkpoint is written at a time; once stopped no more are started and the one being written gives up
+static std::mutex checkpointLock;
+static std::condition_variable checkpointDone;
+static bool checkpointing = false;
+static std::atomic<bool> checkpointStopped(false);
+
+static void checkpointFinished()
+{
+    std::lock_guard<std::mutex> guard(checkpointLock);
+    checkpointing = false;
+    checkpointDone.notify_all();
+}
+
+// waits for the checkpoint being written, the files can be removed afterwards
+static void stopCheckpointing()
+{
+    std::unique_lock<std::mutex> guard(checkpointLock);
+    checkpointStopped = true;
+    checkpointDone.wait(guard, [] { return !checkpointing; });
+}
+
+static void writeSized(std::ostream& out, std::string const& data)
+{
+    std::uint64_t size = data.size();
+    out.write(reinterpret_cast<char const*>(&size), sizeof(size));
+    out.write(data.data(), data.size());
+}
+
+static bool readSized(std::istream& in, std::string* data)
+{
+    std::uint64_t size;
+    if (!in.read(reinterpret_cast<char*>(&size), sizeof(size)) || size > std::numeric_limits<std::uint32_t>::max())
+        return false;
+    data->resize(static_cast<std::size_t>(size));
+    return size == 0 || in.read(&(*data)[0], data->size());
+}
+
+// a thread routine, written aside and renamed over the previous checkpoint so that a crash at any point leaves
+// a whole one behind
+static void writeCheckpoint(PersistentState snapshot, int nextBlockIdx)
+{
+    std::string temporary = std::string(transitionCheckpointFile) + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        std::uint64_t fingerprint = blocks.fingerprint();
+        std::uint64_t next = nextBlockIdx;
+        std::uint64_t count = 0;
+        out.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        out.write(reinterpret_cast<char const*>(&fingerprint), sizeof(fingerprint));
+        out.write(reinterpret_cast<char const*>(&next), sizeof(next));
+        std::streampos countAt = out.tellp();
+        out.write(reinterpret_cast<char const*>(&count), sizeof(count));
+        for (PersistentState::Cursor i(snapshot, ""); i.valid() && !checkpointStopped; i.next())
+        {
+            if (i.value().size() > 0)
+            {
+                writeSized(out, i.key());
+                writeSized(out, i.value());
+                ++count;
+            }
         }
-        else
+        out.seekp(countAt);
+        out.write(reinterpret_cast<char const*>(&count), sizeof(count));
+        out.close();
+        // the snapshot shares its nodes with transitioningState, it is let go of before the process may exit
+        snapshot = PersistentState();
+        if (!out || checkpointStopped)
         {
-            std::stringstream error;
-            error << "invalid command: '" << cmd << "'";
-            throw sawtooth::InvalidTransaction(error.str());
+            if (!out)
+            {
+                LOG4CXX_ERROR(logger, "Can't write the replay checkpoint " << temporary);
+            }
+            std::remove(temporary.c_str());
+            checkpointFinished();
+            return;
         }
     }
-
-    void doApply(std::string const& cmd, nlohmann::json const& query, std::string const& guid, std::string const& sighash)
+#if !IS_LINUX
+    std::remove(transitionCheckpointFile);
+#endif
+    if (std::rename(temporary.c_str(), transitionCheckpointFile) != 0)
     {
-        ctx.guid = guid;
-        ctx.sighash = sighash;
+        LOG4CXX_ERROR(logger, "Can't replace the replay checkpoint " << transitionCheckpointFile);
+        std::remove(temporary.c_str());
+    }
+    checkpointFinished();
+}
 
-        Apply(cmd, query);
+// called with stateUpdateLock held once a block is in transitioningState, the snapshot costs nothing to take and
+// is written out on a thread of its own; a checkpoint still being written makes this one wait for the next turn
+static void checkpointBlock(int blockIdx)
+{
+    int next = blockIdx + 1;
+    if (next % TRANSITION_CHECKPOINT_BLOCKS != 0 || static_cast<std::size_t>(next) >= blocks.size())
+        return;
+    std::lock_guard<std::mutex> guard(checkpointLock);
+    if (checkpointing || checkpointStopped)
+        return;
+    checkpointing = true;
+    std::thread(writeCheckpoint, transitioningState, next).detach();
+}
 
-        ctx.currentState.insert(tipCurrentState.begin(), tipCurrentState.end());
-        tipCurrentState.swap(ctx.currentState);
-        ctx.currentState.clear();
+// picks a replay up at the checkpoint if it was taken from the same transition data, the block it names is
+// replayed from its first transaction on
+static bool restoreCheckpoint()
+{
+    std::ifstream in(transitionCheckpointFile, std::ios::binary);
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    std::uint64_t fingerprint;
+    std::uint64_t next;
+    std::uint64_t count;
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 ||
+        !in.read(reinterpret_cast<char*>(&fingerprint), sizeof(fingerprint)) || !in.read(reinterpret_cast<char*>(&next), sizeof(next)) ||
+        !in.read(reinterpret_cast<char*>(&count), sizeof(count)))
+    {
+        return false;
+    }
+    if (fingerprint != blocks.fingerprint() || next == 0 || next >= blocks.size())
+    {
+        LOG4CXX_INFO(logger, "The replay checkpoint was taken from other transition data, replaying from the start");
+        return false;
     }
 
-    void execute(std::vector<std::uint8_t>& payload, std::string const& guid, std::string const& sighash)
+    // written in key order, anything else isn't a checkpoint this processor wrote
+    std::vector<std::pair<std::string, std::string>> entries;
+    std::pair<std::string, std::string> entry;
+    for (std::uint64_t i = 0; i < count; ++i)
     {
-        if (payload.size() > 0 && guid.size() > 0)
+        if (!readSized(in, &entry.first) || !readSized(in, &entry.second))
         {
-            std::string cmd;
-            auto query = cborToParams(payload, &cmd);
-            ctx.replaying = true;
-            doApply(cmd, query, guid, sighash);
-            ctx.replaying = false;
+            LOG4CXX_ERROR(logger, "The replay checkpoint is cut short, replaying from the start");
+            return false;
+        }
+        if (!entries.empty() && !(entries.back().first < entry.first))
+        {
+            LOG4CXX_ERROR(logger, "The replay checkpoint is out of order, replaying from the start");
+            return false;
         }
+        entries.push_back(std::move(entry));
     }
+    PersistentState restored = PersistentState::fromSorted(&entries);
+
+    transitioningState = restored;
+    restoredState = restored;
+    restoredBlockIdx = static_cast<int>(next);
+    tipCurrentState.clear();
+    updatedBlockIdx = static_cast<int>(next);
+    updatedTxIdx = -1;
+    LOG4CXX_INFO(logger, "Resuming the replay at block " << next << " with " << count << " entries");
+    return true;
+}
 
-    void Apply(std::string const& cmd, nlohmann::json const& query, std::string const& guid, std::string const& sighash)
+static void killer()
+{
+    for (;;)
     {
-        if (ctx.transitioning)
+        std::this_thread::sleep_for(60s);
+        auto now = std::chrono::system_clock::now();
+        bool idle;
         {
-            auto found = txguid2prevblockidx.find(guid);
-            if (found == txguid2prevblockidx.end())
-            {
-                cleanupTransitioning();
-            }
-            else
-            {
-                int tip = found->second.block;
-                int currentBlockIdx = tip + 1;
-                int txIdx = found->second.txIdx;
-
-                std::lock_guard<std::mutex> guard(stateUpdateLock);
-
-                if (currentBlockIdx > updatedBlockIdx)
-                {
-                    ctx.tip = updatedBlockIdx - 1;
-                    for (int i = updatedTxIdx + 1; i < blocks[updatedBlockIdx].txs.size(); ++i)
-                    {
-                        auto& tx = blocks[updatedBlockIdx].txs[i];
-                        if (tx.sighash.size() > 0)
-                            execute(tx.payload, tx.guid, tx.sighash);
-                    }
-                    for (auto& e : tipCurrentState)
-                        transitioningState[e.first] = e.second;
-                    tipCurrentState.clear();
-                    for (int i = updatedBlockIdx + 1; i < currentBlockIdx; ++i)
-                    {
-                        ctx.tip = i - 1;
-                        for (auto& tx : blocks[i].txs)
-                            if (tx.sighash.size() > 0)
-                                execute(tx.payload, tx.guid, tx.sighash);
-
-                        for (auto& e : tipCurrentState)
-                            transitioningState[e.first] = e.second;
-                        tipCurrentState.clear();
-                    }
-
-                    ctx.tip = tip;
-                    for (int i = 0; i < txIdx; ++i)
-                    {
-                        auto& tx = blocks[updatedBlockIdx].txs[i];
-                        if (tx.sighash.size() > 0)
-                            execute(tx.payload, tx.guid, tx.sighash);
-                    }
-                }
-                else if (currentBlockIdx == updatedBlockIdx)
-                {
-                    ctx.tip = tip;
-                    if (txIdx <= updatedTxIdx)
-                    {
-                        tipCurrentState.clear();
-                        for (int i = 0; i < txIdx; ++i)
-                        {
-                            auto& tx = blocks[updatedBlockIdx].txs[i];
-                            if (tx.sighash.size() > 0)
-                                execute(tx.payload, tx.guid, tx.sighash);
-                        }
-                    }
-                    else
-                    {
-                        for (int i = updatedTxIdx + 1; i < txIdx; ++i)
-                        {
-                            auto& tx = blocks[updatedBlockIdx].txs[i];
-                            if (tx.sighash.size() > 0)
-                                execute(tx.payload, tx.guid, tx.sighash);
-                        }
-                    }
-                }
-
-                doApply(cmd, query, guid, sighash);
-
-                updatedBlockIdx = currentBlockIdx;
-                updatedTxIdx = txIdx;
-
-                if (updatedBlockIdx == blocks.size() - 1 && updatedTxIdx == blocks[updatedBlockIdx].txs.size() - 1)
-                {
-                    std::cout << "Revalidated last block, terminating in a minute" << std::endl;
-                    std::thread(cleanupTransitioning).detach();
-                }
-            }
             std::lock_guard<std::mutex> guard(killerLock);
-            lastTime = std::chrono::system_clock::now();
-            if (!killerStarted)
-            {
-                std::thread(killer).detach();
-                killerStarted = true;
-            }
-        }
-        else
-        {
-            Apply(cmd, query);
+            idle = lastTime + 300s < now;
         }
+        if (idle)
+            cleanupTransitioning();
     }
+}
 
-    void Apply()
+static void updateSettings()
+{
+    // this is a thread routine, we don't join the thread and don't care if it's in progress when the process termitates, just terminating it is ok
+    for (;;)
     {
-        std::cout << "Applicator::Apply" << std::endl;
+        std::this_thread::sleep_for(6s);
+        doUpdateSettings();
+        logVerbStats();
+        std::this_thread::sleep_for(6000s);
+    }
+}
 
-        std::string cmd;
-        auto query = cborToParams(&cmd);
-        auto nounce = txn->header()->GetValue(sawtooth::TransactionHeaderField::TransactionHeaderNonce);
-        Apply(cmd, query, nounce, sha512id(compress(txn->header()->GetValue(sawtooth::TransactionHeaderField::TransactionHeaderSignerPublicKey))));
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static void toHex(std::uint8_t const* bytes, std::size_t size, char* out)
+{
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        out[2 * i] = HEX_DIGITS[bytes[i] >> 4];
+        out[2 * i + 1] = HEX_DIGITS[bytes[i] & 0x0f];
     }
+}
+
+static int fromHexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
 
-    static nlohmann::json cborToParams(std::vector<uint8_t> const& payload, std::string* cmd)
+// decodes lowercase hex only, the same alphabet isHex accepts
+static bool fromHex(boost::string_ref hex, std::uint8_t* out)
+{
+    if (hex.size() % 2)
+        return false;
+    for (std::size_t i = 0; i < hex.size(); i += 2)
     {
-        nlohmann::json query = nlohmann::json::from_cbor(payload);
+        int hi = fromHexDigit(hex[i]);
+        int lo = fromHexDigit(hex[i + 1]);
+        if (hi < 0 || lo < 0)
+            return false;
+        out[i / 2] = static_cast<std::uint8_t>(hi << 4 | lo);
+    }
+    return true;
+}
 
-        if (!query.is_object())
-        {
-            throw sawtooth::InvalidTransaction("CBOR Object as the encoded command");
-        }
+static void sha512(const std::string& message, std::uint8_t* digest)
+{
+    CryptoPP::SHA512().CalculateDigest(digest, reinterpret_cast<CryptoPP::byte const*>(message.data()), message.size());
+}
 
-        auto verb = query.find("v");
-        if (verb == query.end())
-        {
-            throw sawtooth::InvalidTransaction("verb is required");
-        }
-        *cmd = trimQuotes(verb->dump());
+static std::string sha512(const std::string& message)
+{
+    std::uint8_t digest[CryptoPP::SHA512::DIGESTSIZE];
+    sha512(message, digest);
+    std::string ret(2 * sizeof(digest), '\0');
+    toHex(digest, sizeof(digest), &ret[0]);
+    return ret;
+}
 
-        return query;
-    }
+static std::string sha512id(const std::string& message)
+{
+    std::uint8_t digest[CryptoPP::SHA512::DIGESTSIZE];
+    sha512(message, digest);
+    std::string ret(2 * sizeof(digest) - SKIP_TO_GET_60, '\0');
+    toHex(digest + SKIP_TO_GET_60 / 2, sizeof(digest) - SKIP_TO_GET_60 / 2, &ret[0]);
+    assert(ret.length() == MERKLE_ADDRESS_LENGTH - NAMESPACE_PREFIX_LENGTH - PREFIX_LENGTH);
+    return ret;
+}
 
-    nlohmann::json cborToParams(std::string* cmd)
-    {
-        const std::string& rawData = txn->payload();
-        std::vector<uint8_t> dataVector = toVector(rawData);
+static std::string mapNamespace(std::string const& namespaceString)
+{
+    std::string ns = sha512(namespaceString);
+    return ns.substr(0, NAMESPACE_PREFIX_LENGTH);
+}
 
-        return cborToParams(dataVector, cmd);
-    };
+static std::string namespacePrefix = mapNamespace(NAMESPACE);
 
-    boost::multiprecision::cpp_int lastBlockInt(Ctx const& ctx)
-    {
-        if (ctx.transitioning)
-            return ctx.tip;
-        else
-            return boost::multiprecision::cpp_int(state->GetTip() - 1);
-    }
+static bool isHex(const std::string& str)
+{
+    return str.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
 
-    std::string lastBlock(Ctx const& ctx)
+// a merkle address kept as bytes: namespace (3), prefix (2) and the last 30 bytes of a SHA-512 digest,
+// it is hex encoded only when passed to sawtooth::GlobalState
+struct StateAddress
+{
+    static const std::size_t SIZE = MERKLE_ADDRESS_LENGTH / 2;
+    static const std::size_t ID_OFFSET = (NAMESPACE_PREFIX_LENGTH + PREFIX_LENGTH) / 2;
+
+    std::uint8_t bytes[SIZE];
+
+    std::string hex() const
     {
-        return toString(lastBlockInt(ctx));
+        std::string ret(MERKLE_ADDRESS_LENGTH, '\0');
+        toHex(bytes, SIZE, &ret[0]);
+        return ret;
     }
 
-    bool getState(sawtooth::GlobalState* state, std::string* stateData, std::string const& id)
+    bool operator==(StateAddress const& other) const
     {
-        if (ctx.transitioning)
-        {
-            auto s = ctx.currentState.find(id);
-            if (s != ctx.currentState.end())
-            {
-                *stateData = s->second;
-                return true;
-            }
-            s = tipCurrentState.find(id);
-            if (s != tipCurrentState.end())
-            {
-                *stateData = s->second;
-                return true;
-            }
-            s = transitioningState.find(id);
-            if (s != transitioningState.end())
-            {
-                *stateData = s->second;
-                return true;
-            }
-            return true;
-        }
-        else
-        {
-            return state->GetState(stateData, id);
-        }
+        return std::memcmp(bytes, other.bytes, SIZE) == 0;
     }
 
-    void setState(sawtooth::GlobalState* state, std::vector<sawtooth::GlobalState::KeyValue> const& states)
+    bool operator!=(StateAddress const& other) const
     {
-        if (ctx.transitioning)
-        {
-            for (auto i : states)
-            {
-                ctx.currentState[i.first] = i.second;
-#ifndef NDEBUG
-                //std::stringstream s;
-                //s << i.first << ": " << i.second << "\n";
-                //OutputDebugStringA(s.str().c_str());
-#endif
-            }
-        }
-        if (!ctx.replaying)
-            state->SetState(states);
+        return !(*this == other);
     }
 
-    void setState(sawtooth::GlobalState* state, std::string const& stateData, std::string const& id)
+    // same order as the hex form
+    bool operator<(StateAddress const& other) const
     {
-        if (ctx.transitioning)
-        {
-            ctx.currentState[id] = stateData;
-#ifndef NDEBUG
-            //std::stringstream s;
-            //s << id << ": " << stateData << "\n";
-            //OutputDebugStringA(s.str().c_str());
-#endif
-        }
-        if (!ctx.replaying)
-            state->SetState(id, stateData);
+        return std::memcmp(bytes, other.bytes, SIZE) < 0;
     }
 
-    void deleteState(sawtooth::GlobalState* state, std::string const& id)
-    {
-        if (ctx.transitioning)
-            ctx.currentState[id] = std::string();
+    // the namespace and the prefix, the rest is filled by the caller
+    static StateAddress withPrefix(char const* prefix);
+};
 
-        if (!ctx.replaying)
-            state->DeleteState(id);
-    }
+static_assert(std::is_trivially_copyable<StateAddress>::value, "StateAddress is copied as plain bytes");
 
-    void setState(sawtooth::GlobalStateUPtr const& state, std::string const& stateData, std::string const& id)
+struct StateAddressHash
+{
+    std::size_t operator()(StateAddress const& address) const
     {
-        setState(state.get(), id, stateData);
+        // the id part is a digest already, no need to hash it again
+        std::size_t ret;
+        std::memcpy(&ret, address.bytes + StateAddress::ID_OFFSET, sizeof(ret));
+        return ret;
     }
+};
 
-    void setState(sawtooth::GlobalStateUPtr const& state, std::vector<sawtooth::GlobalState::KeyValue> const& states)
-    {
-        setState(state.get(), states);
-    }
+static StateAddress namespaceAddress()
+{
+    StateAddress ret = {};
+    fromHex(namespacePrefix, ret.bytes);
+    return ret;
+}
 
-    void deleteState(sawtooth::GlobalStateUPtr const& state, std::string const& id)
-    {
-        deleteState(state.get(), id);
-    }
+static const StateAddress NAMESPACE_ADDRESS = namespaceAddress();
 
-    std::string getStateData(std::string const& id, bool existing = false)
+StateAddress StateAddress::withPrefix(char const* prefix)
+{
+    StateAddress ret = NAMESPACE_ADDRESS;
+    fromHex(boost::string_ref(prefix, PREFIX_LENGTH), ret.bytes + NAMESPACE_PREFIX_LENGTH / 2);
+    return ret;
+}
+
+static StateAddress makeAddress(char const* prefix, std::string const& key)
+{
+    std::uint8_t digest[CryptoPP::SHA512::DIGESTSIZE];
+    sha512(key, digest);
+    StateAddress ret = StateAddress::withPrefix(prefix);
+    std::memcpy(ret.bytes + StateAddress::ID_OFFSET, digest + SKIP_TO_GET_60 / 2, StateAddress::SIZE - StateAddress::ID_OFFSET);
+    return ret;
+}
+
+static void makeAddresses(char const* prefix, std::vector<std::string> const& keys, std::vector<StateAddress>* addresses)
+{
+    addresses->clear();
+    addresses->reserve(keys.size());
+    for (auto const& key : keys)
     {
-        return getStateData(state.get(), id, existing);
+        addresses->push_back(makeAddress(prefix, key));
     }
+}
 
-    std::string getStateData(sawtooth::GlobalState* state, std::string const& id, bool existing = false)
+// sighash is expected to be produced by sha512id
+static StateAddress walletAddress(std::string const& sighash)
+{
+    StateAddress ret = StateAddress::withPrefix(WALLET);
+    if (sighash.size() != 2 * (StateAddress::SIZE - StateAddress::ID_OFFSET) || !fromHex(sighash, ret.bytes + StateAddress::ID_OFFSET))
     {
-        std::string stateData;
+        throw sawtooth::InvalidTransaction("Invalid sighash");
+    }
+    return ret;
+}
 
-        if (!getState(state , &stateData, id))
-        {
-            //The section below is commented out because sawtooth 1.0.5 inconsistently returns either key:None or empty list for the same state query
-            //      when porting to rust make sure that in sawtooth 1.2 that doesn't happen or doesn't have a special meaning
-            //    throw sawtooth::InvalidTransaction("Failed to retrieve the state " + id);
-        }
+static std::string encodeBase64(std::vector<std::uint8_t> const& in)
+{
+    std::stringstream out;
 
-        if (existing && stateData.empty())
+    unsigned int val = 0;
+    int valb = -6;
+    for (unsigned char c : in)
+    {
+        val = (val << 8) + c;
+        valb += 8;
+        while (valb >= 0)
         {
-            throw sawtooth::InvalidTransaction("Existing state expected " + id);
+            out << (base64lookupString[(val >> valb) & 0x3F]);
+            valb -= 6;
         }
-        return stateData;
     }
-
-    static void addState(std::vector<sawtooth::GlobalState::KeyValue>* states, std::string const& id, google::protobuf::Message const& message)
+    if (valb > -6)
     {
-        std::string data;
-        message.SerializeToString(&data);
-        states->push_back(sawtooth::GlobalState::KeyValue(id, data));
+        out << (base64lookupString[((val << 8) >> (valb + 8)) & 0x3F]);
     }
-
-private:
-    void verifyGatewaySigner()
+    for (int i = 0, rest = in.size() % 3; i < rest; ++i)
     {
-        if (transitioning)
-            return;
-        const std::string mySighash = getSighash();
-        auto actualSettings = settings.load();
-        auto setting = actualSettings->find("sawtooth.gateway.sighash");
-        if (setting == actualSettings->end())
-        {
-            doUpdateSettings();
-            actualSettings = settings.load();
-            setting = actualSettings->find("sawtooth.gateway.sighash");
-            if (setting == actualSettings->end())
-                throw sawtooth::InvalidTransaction("Gateway sighash is not configured");
-        }
-        if (mySighash != setting->second)
-        {
-            throw sawtooth::InvalidTransaction("Only gateway sighash can perform this operation");
-        }
+        out << '=';
     }
+    return out.str();
+}
 
-    void verify(std::stringstream const& gatewayCommand)
+static std::string toString(std::vector<std::uint8_t> const& v)
+{
+    const char* data = reinterpret_cast<const char*>(v.data());
+    std::string out(data, data + v.size());
+    return out;
+}
+
+static ::google::protobuf::uint64 parseUint64(std::string const& numberString) {
+    ::google::protobuf::uint64 number;
+    std::istringstream iss(numberString);
+    iss >> number;
+    if (iss.fail() || !iss.eof())
     {
-        if (transitioning)
-            return;
+        throw sawtooth::InvalidTransaction("Invalid number");
+    }
+    return number;
+}
 
-        std::string response = "";
-        try
-        {
-            std::lock_guard<std::mutex> guard(localGatewayLock);
-            if (localGateway->send(gatewayCommand.str()))
-            {
-                localGateway->receive(response);
-            }
-            if (response.empty() || response == "miss") // couldn't interact with the local gateway or it wasn't able to validate
-            {
-                // need to reset the socket here or else it will always fail next time
-                // TODO: need a way to handle the local gateway coming back online and start replying to old messages
-                localGateway->close();
-                delete localGateway;
-                localGateway = new zmqpp::socket(*socketContext, zmqpp::socket_type::request);
-                localGateway->connect(URL_GATEWAY);
-                localGateway->set(zmqpp::socket_option::receive_timeout, LOCAL_SOCKET_TIMEOUT_MILLISECONDS);
+enum class ParamType
+{
+    Id,             // object or address id, lowercased
+    LowerString,    // free text, lowercased
+    String,         // free text as sent
+    Bigint,         // non-negative integer, the text is kept as sent
+    SignedBigint,   // integer, the text is kept as sent
+    Uint64
+};
 
-                auto address = externalGatewayAddress.load();
-                if (!address->empty())
-                {
-                    externalGateway->connect(*address);
-                    try
-                    {
-                        if (externalGateway->send(gatewayCommand.str()))
-                        {
-                            externalGateway->receive(response);
-                        }
-                    }
-                    catch (...)
-                    {
-                        externalGateway->disconnect(*address);
-                        throw;
-                    }
-                    externalGateway->disconnect(*address);
-                }
-            }
-        }
-        catch (...)
+struct ParamSpec
+{
+    int index;
+    ParamType type;
+    char const* name;
+};
+
+struct Arg
+{
+    boost::string_ref text;
+    boost::multiprecision::cpp_int bigint;
+    ::google::protobuf::uint64 number;
+    std::string storage;
+
+    std::string str() const
+    {
+        return std::string(text.data(), text.size());
+    }
+};
+
+// a verb's parameters decoded according to its schema, in schema order
+template<std::size_t N>
+struct Args
+{
+    Arg values[N];
+
+    Arg const& operator[](std::size_t i) const
+    {
+        return values[i];
+    }
+};
+
+static const ::google::protobuf::uint64 POW10_19 = 10000000000000000000ull;
+
+// plain decimals without a leading zero are converted in 19 digit chunks, everything else
+// (octal, hex, signs, garbage) goes through cpp_int to keep its exact acceptance and errors
+static boost::multiprecision::cpp_int getBigint(boost::string_ref bigint, bool allowNegative)
+{
+    bool plain = !bigint.empty() && (bigint[0] != '0' || bigint.size() == 1);
+    for (std::size_t i = 0; plain && i < bigint.size(); ++i)
+    {
+        plain = bigint[i] >= '0' && bigint[i] <= '9';
+    }
+    if (!plain)
+    {
+        return getBigint(std::string(bigint.data(), bigint.size()), allowNegative);
+    }
+
+    boost::multiprecision::cpp_int ret = 0;
+    std::size_t pos = 0;
+    std::size_t chunk = bigint.size() % 19;
+    if (chunk == 0)
+    {
+        chunk = 19;
+    }
+    while (pos < bigint.size())
+    {
+        ::google::protobuf::uint64 part = 0;
+        for (std::size_t end = pos + chunk; pos < end; ++pos)
         {
-            throw;
+            part = part * 10 + (bigint[pos] - '0');
         }
-        if (response != "good")
+        if (ret != 0)
         {
-            throw sawtooth::InvalidTransaction("Couldn't validate the transaction");
+            ret *= POW10_19;
         }
+        ret += part;
+        chunk = 19;
     }
+    return ret;
+}
 
-    void award(bool newFormula, boost::multiprecision::cpp_int const& blockIdx, std::string const& signer)
+static ::google::protobuf::uint64 parseUint64(boost::string_ref numberString)
+{
+    if (numberString.empty() || numberString.size() > 19)
     {
-        boost::multiprecision::cpp_int reward;
-        std::string rewardString;
-        if (newFormula)
-        {
-            int period = (blockIdx / BLOCKS_IN_PERIOD_UPDATE1).convert_to<int>();
-            double fraction = pow(19.0 / 20.0, period);
-            std::ostringstream fractionStringBuilder;
-            fractionStringBuilder << std::fixed << fraction;
-            std::string fractionString = fractionStringBuilder.str();
-            size_t pos = fractionString.find('.');
-            assert(pos > 0);
-            std::ostringstream fractionInWeiStringBuilder;
-            if (fractionString[0] != '0')
-            {
-                fractionInWeiStringBuilder << fractionString.substr(0, pos) << std::left << std::setfill('0') << std::setw(18) << fractionString.substr(pos + 1);
-            }
-            else
-            {
-                int pos = 2;
-                for (; fractionString[pos] == '0'; ++pos);
-                fractionInWeiStringBuilder << std::left << std::setfill('0') << std::setw(20 - pos) << fractionString.substr(pos);
-            }
-            std::string fractionInWeiString = fractionInWeiStringBuilder.str();
-            reward = boost::multiprecision::cpp_int(28) * boost::multiprecision::cpp_int(fractionInWeiString);
-            rewardString = toString(reward);
-        }
-        else
+        return parseUint64(std::string(numberString.data(), numberString.size()));
+    }
+    ::google::protobuf::uint64 number = 0;
+    for (char c : numberString)
+    {
+        if (c < '0' || c > '9')
         {
-            reward = REWARD_AMOUNT;
-            rewardString = REWARD_AMOUNT_STRING;
+            return parseUint64(std::string(numberString.data(), numberString.size()));
         }
+        number = number * 10 + (c - '0');
+    }
+    return number;
+}
 
-        if (reward > 0)
+// lowercases the way boost::to_lower does in the classic locale, copying only when needed
+static boost::string_ref toLower(boost::string_ref text, std::string* storage)
+{
+    std::size_t i = 0;
+    while (i < text.size() && (text[i] < 'A' || text[i] > 'Z'))
+    {
+        ++i;
+    }
+    if (i == text.size())
+    {
+        return text;
+    }
+    storage->assign(text.data(), text.size());
+    for (; i < storage->size(); ++i)
+    {
+        char c = (*storage)[i];
+        if (c >= 'A' && c <= 'Z')
         {
-            const std::string signerSighash = sha512id(signer);
-            const std::string walletId = namespacePrefix + WALLET + signerSighash;
-            std::string stateData = getStateData(walletId);
-            Wallet wallet;
-            if (stateData.empty())
-            {
-                wallet.set_amount(rewardString);
-            }
-            else
-            {
-                wallet.ParseFromString(stateData);
-                boost::multiprecision::cpp_int balance = getBigint(wallet.amount());
-                balance += reward;
-                wallet.set_amount(toString(balance));
-            }
-            std::vector<sawtooth::GlobalState::KeyValue> states;
-            addState(&states, walletId, wallet);
-            setState(state, states);
+            (*storage)[i] = c - 'A' + 'a';
         }
     }
+    return boost::string_ref(*storage);
+}
 
-    void reward(boost::multiprecision::cpp_int const& processedBlockIdx, boost::multiprecision::cpp_int const& uptoBlockIdx)
+static const ParamSpec SEND_FUNDS_PARAMS[] = {
+    { 1, ParamType::Bigint, "amount" },
+    { 2, ParamType::Id, "sighash" } };
+static const ParamSpec REGISTER_ADDRESS_PARAMS[] = {
+    { 1, ParamType::LowerString, "blockchain" },
+    { 2, ParamType::String, "address" },
+    { 3, ParamType::LowerString, "network" } };
+static const ParamSpec REGISTER_TRANSFER_PARAMS[] = {
+    { 1, ParamType::SignedBigint, "gain" },
+    { 2, ParamType::Id, "orderId" },
+    { 3, ParamType::Id, "blockchainTxId" } };
+// AddAskOrder and AddBidOrder
+static const ParamSpec ORDER_PARAMS[] = {
+    { 1, ParamType::Id, "addressId" },
+    { 2, ParamType::Bigint, "amount" },
+    { 3, ParamType::Bigint, "interest" },
+    { 4, ParamType::Bigint, "maturity" },
+    { 5, ParamType::Bigint, "fee" },
+    { 6, ParamType::Uint64, "expiration" } };
+static const ParamSpec ADD_OFFER_PARAMS[] = {
+    { 1, ParamType::Id, "askOrderId" },
+    { 2, ParamType::Id, "bidOrderId" },
+    { 3, ParamType::Uint64, "expiration" } };
+static const ParamSpec ADD_DEAL_ORDER_PARAMS[] = {
+    { 1, ParamType::Id, "offerId" },
+    { 2, ParamType::Uint64, "expiration" } };
+// CompleteDealOrder, CloseDealOrder and Exempt
+static const ParamSpec DEAL_ORDER_TRANSFER_PARAMS[] = {
+    { 1, ParamType::Id, "dealOrderId" },
+    { 2, ParamType::Id, "transferId" } };
+static const ParamSpec LOCK_DEAL_ORDER_PARAMS[] = {
+    { 1, ParamType::Id, "dealOrderId" } };
+static const ParamSpec ADD_REPAYMENT_ORDER_PARAMS[] = {
+    { 1, ParamType::Id, "dealOrderId" },
+    { 2, ParamType::Id, "addressId" },
+    { 3, ParamType::Bigint, "amount" },
+    { 4, ParamType::Uint64, "expiration" } };
+static const ParamSpec COMPLETE_REPAYMENT_ORDER_PARAMS[] = {
+    { 1, ParamType::Id, "repaymentOrderId" } };
+static const ParamSpec CLOSE_REPAYMENT_ORDER_PARAMS[] = {
+    { 1, ParamType::Id, "repaymentOrderId" },
+    { 2, ParamType::Id, "transferId" } };
+static const ParamSpec COLLECT_COINS_PARAMS[] = {
+    { 1, ParamType::Id, "ethAddress" },
+    { 2, ParamType::Bigint, "amount" },
+    { 3, ParamType::Id, "blockchainTxId" } };
+static const ParamSpec HOUSEKEEPING_PARAMS[] = {
+    { 1, ParamType::Bigint, "blockIdx" } };
+
+template<std::size_t N>
+static void decodeParams(Params const& query, ParamSpec const (&specs)[N], Args<N>* args)
+{
+    for (std::size_t i = 0; i < N; ++i)
     {
-        assert(uptoBlockIdx == 0 || uptoBlockIdx > processedBlockIdx);
+        ParamSpec const& spec = specs[i];
+        Arg& arg = args->values[i];
+        arg.text = getParam(query, spec.index, spec.name);
+        switch (spec.type)
+        {
+        case ParamType::Id:
+        case ParamType::LowerString:
+            arg.text = toLower(arg.text, &arg.storage);
+            break;
+        case ParamType::String:
+            break;
+        case ParamType::Bigint:
+            arg.bigint = getBigint(arg.text, false);
+            break;
+        case ParamType::SignedBigint:
+            arg.bigint = getBigint(arg.text, true);
+            break;
+        case ParamType::Uint64:
+            arg.number = parseUint64(arg.text);
+            break;
+        }
+    }
+}
 
-        try
-        {
-            bool newFormula = false;
+static std::string toString(boost::multiprecision::cpp_int const& bigint)
+{
+    std::stringstream ss;
+    ss << bigint;
+    return ss.str();
+}
 
-            if (ctx.transitioning)
-            {
-                int setBlock = (ctx.tip >= 278890 && ctx.tip <= 278904) ? 277800 : 278910;
-                boost::multiprecision::cpp_int updateBlock(setBlock);
-                if (updateBlock + 500 < processedBlockIdx)
-                    newFormula = true;
+static bool parseAddress(std::string const& hex, StateAddress* address)
+{
+    return hex.size() == MERKLE_ADDRESS_LENGTH && fromHex(hex, address->bytes);
+}
 
-                for (boost::multiprecision::cpp_int i = uptoBlockIdx; i > processedBlockIdx; --i)
-                {
-                    int idx = i.convert_to<int>();
-                    SimpleBlock const& block = blocks[idx];
+// the expiry index has an entry per order that can expire, it holds the address of the order; the bucket of blocks
+// the order expires in is spelled out in the address so that the entries of a bucket are listed with one prefix scan
+static std::string expiryPrefix(boost::multiprecision::cpp_int const& bucket)
+{
+    std::ostringstream ss;
+    ss << namespacePrefix << EXPIRY << std::hex << std::setw(EXPIRY_BUCKET_DIGITS) << std::setfill('0') << bucket.convert_to<std::uint64_t>();
+    return ss.str();
+}
 
-                    award(newFormula, i, block.signer);
-                }
-                return;
-            }
+// the rest of the address is a digest of the whole order address, the ids alone repeat across prefixes
+static StateAddress expiryEntry(boost::multiprecision::cpp_int const& expiresAt, StateAddress const& order)
+{
+    StateAddress ret;
+    fromHex(expiryPrefix(expiresAt / EXPIRY_BUCKET_BLOCKS), ret.bytes);
+    std::uint8_t digest[CryptoPP::SHA512::DIGESTSIZE];
+    sha512(std::string(reinterpret_cast<char const*>(order.bytes), StateAddress::SIZE), digest);
+    std::size_t offset = StateAddress::ID_OFFSET + EXPIRY_BUCKET_DIGITS / 2;
+    std::memcpy(ret.bytes + offset, digest + (SKIP_TO_GET_60 + EXPIRY_BUCKET_DIGITS) / 2, StateAddress::SIZE - offset);
+    return ret;
+}
 
-            auto actualSettings = settings.load();
-            auto i = actualSettings->find("sawtooth.validator.update1");
-            if (i != actualSettings->end())
-            {
-                std::string updateBlockStr = i->second;
-                boost::multiprecision::cpp_int updateBlock = getBigint(updateBlockStr);
-                if (updateBlock + 500 < processedBlockIdx)
-                    newFormula = true;
-            }
+// the fee ledger holds, per signer and block, the transaction fees that are to be refunded a year later; the
+// bucket is spelled out in the address so that all the entries of a block are listed with one prefix scan
+static std::string feeLedgerPrefix(boost::multiprecision::cpp_int const& bucket)
+{
+    std::ostringstream ss;
+    ss << namespacePrefix << FEE_LEDGER << std::hex << std::setw(FEE_LEDGER_BUCKET_DIGITS) << std::setfill('0') << bucket.convert_to<std::uint64_t>();
+    return ss.str();
+}
 
-            //TODO: use ClientBlockList insted of ClientBlockGetById to retrieve multiple blocks
-            //TODO: combine awards for the same miner if possible
+static std::string feeLedgerAddress(boost::multiprecision::cpp_int const& block, std::string const& sighash)
+{
+    std::string prefix = feeLedgerPrefix(block / FEE_LEDGER_BUCKET_BLOCKS);
+    return prefix + sha512(sighash).substr(SKIP_TO_GET_60 + FEE_LEDGER_BUCKET_DIGITS);
+}
 
-            boost::multiprecision::cpp_int const& lastBlockIdx = (uptoBlockIdx == 0) ?
-                processedBlockIdx + BLOCK_REWARD_PROCESSING_COUNT :
-                uptoBlockIdx;
+// a bucket is refunded once the last block in it is more than a year old; with a block per bucket that is the
+// height a Fee record expires at
+static bool feeLedgerBucketDue(boost::multiprecision::cpp_int const& bucket, boost::multiprecision::cpp_int const& blockIdx)
+{
+    return (bucket + 1) * FEE_LEDGER_BUCKET_BLOCKS + YEAR_OF_BLOCKS <= blockIdx;
+}
 
-            const std::string* sig = &txn->block_signature();
-            if (sig->empty()) {
-                for (boost::multiprecision::cpp_int i = processedBlockIdx + 1; i <= lastBlockIdx; ++i)
-                {
-                    ::google::protobuf::uint64 height = i.convert_to< ::google::protobuf::uint64>();
-                    std::string signer;
-                    contextlessState->GetSigByNum(height, &signer);
-                    award(newFormula, i, signer);
-                }
-            } else {
+// an entry is the sighash of the wallet to refund and the number of fees it paid in the bucket
+static void decodeFeeLedgerEntry(std::string const& data, std::string* sighash, boost::multiprecision::cpp_int* count)
+{
+    auto pos = data.find(' ');
+    if (pos == std::string::npos)
+    {
+        throw sawtooth::InvalidTransaction("Invalid fee ledger entry");
+    }
+    *sighash = data.substr(0, pos);
+    *count = getBigint(data.substr(pos + 1));
+}
 
-                auto first = lastBlockIdx.convert_to< ::google::protobuf::uint64>();
-                auto last = (processedBlockIdx + 1).convert_to< ::google::protobuf::uint64>();
-                std::vector<std::string> signatures;
-                contextlessState->GetRewardBlockSignatures(*sig,signatures, first, last);
+static std::string encodeFeeLedgerEntry(std::string const& sighash, boost::multiprecision::cpp_int const& count)
+{
+    return sighash + " " + toString(count);
+}
 
-                {
-                    boost::multiprecision::cpp_int i = processedBlockIdx;
+// the first block at which Housekeeping removes an order, the rule is expiration < blockIdx - block
+static boost::multiprecision::cpp_int expiresAt(std::string const& block, ::google::protobuf::uint64 expiration)
+{
+    return getBigint(block) + expiration + 1;
+}
 
-                    for(auto signature : signatures){
-                        award(newFormula, ++i, signature);
-                    }
-                }
-            }
-        }
-        catch (sawtooth::InvalidTransaction const&)
-        {
-            throw;
-        }
-        catch (...)
-        {
-            throw sawtooth::InvalidTransaction(RPC_FAILURE);
-        }
-    }
+struct BlockReward
+{
+    boost::multiprecision::cpp_int amount;
+    std::string amountString;
+};
 
-    void addFee(std::string const& sighash, std::vector<sawtooth::GlobalState::KeyValue>* states)
+// 28 * 0.95^period in wei, computed through the same double formatting the reward formula has always used
+static BlockReward periodReward(int period)
+{
+    double fraction = pow(19.0 / 20.0, period);
+    std::ostringstream fractionStringBuilder;
+    fractionStringBuilder << std::fixed << fraction;
+    std::string fractionString = fractionStringBuilder.str();
+    size_t pos = fractionString.find('.');
+    assert(pos > 0);
+    std::ostringstream fractionInWeiStringBuilder;
+    if (fractionString[0] != '0')
     {
-        std::string const& guid = getGuid();
-        const std::string feeId = makeAddress(FEE, guid);
-        Fee fee;
-        fee.set_sighash(sighash);
-        fee.set_block(lastBlock(ctx));
-        addState(states, feeId, fee);
+        fractionInWeiStringBuilder << fractionString.substr(0, pos) << std::left << std::setfill('0') << std::setw(18) << fractionString.substr(pos + 1);
     }
-
-    void addFee(std::string const& sighash, std::vector<sawtooth::GlobalState::KeyValue>* states, std::string const& walletId, Wallet const& wallet)
+    else
     {
-        addFee(sighash, states);
-        addState(states, walletId, wallet);
+        int pos = 2;
+        for (; fractionString[pos] == '0'; ++pos);
+        fractionInWeiStringBuilder << std::left << std::setfill('0') << std::setw(20 - pos) << fractionString.substr(pos);
     }
+    std::string fractionInWeiString = fractionInWeiStringBuilder.str();
+    BlockReward reward;
+    reward.amount = boost::multiprecision::cpp_int(28) * boost::multiprecision::cpp_int(fractionInWeiString);
+    reward.amountString = toString(reward.amount);
+    return reward;
+}
 
-    std::string charge(std::string const& sighash, Wallet* wallet)
+// rewards by period up to the first one that formats to zero, the fraction only decreases so all later ones are zero too
+static std::vector<BlockReward> makeRewardSchedule()
+{
+    std::vector<BlockReward> schedule;
+    for (int period = 0; ; ++period)
     {
-        const std::string walletId = namespacePrefix + WALLET + sighash;
-        std::string stateData = getStateData(walletId, true);
-        wallet->ParseFromString(stateData);
-
-        boost::multiprecision::cpp_int balance = getBigint(wallet->amount());
-        if (balance - TX_FEE < 0)
+        BlockReward reward = periodReward(period);
+        if (reward.amount == 0)
         {
-            throw sawtooth::InvalidTransaction("Insufficient funds");
+            break;
         }
-        wallet->set_amount(toString(balance - TX_FEE));
-
-        return walletId;
+        schedule.push_back(reward);
     }
+    return schedule;
+}
+
+static const std::vector<BlockReward> REWARD_SCHEDULE = makeRewardSchedule();
+static const BlockReward NO_REWARD = { 0, "0" };
+static const BlockReward FIXED_REWARD = { REWARD_AMOUNT, REWARD_AMOUNT_STRING };
 
-    std::string getSighash()
+static BlockReward const& scheduledReward(boost::multiprecision::cpp_int const& blockIdx)
+{
+    if (blockIdx >= BLOCKS_IN_PERIOD_UPDATE1 * REWARD_SCHEDULE.size())
     {
-        if (ctx.transitioning)
-            return ctx.sighash;
-        else
-            return sha512id(compress(txn->header()->GetValue(sawtooth::TransactionHeaderField::TransactionHeaderSignerPublicKey)));
+        return NO_REWARD;
     }
+    std::size_t period = (blockIdx.convert_to< ::google::protobuf::uint64>() / BLOCKS_IN_PERIOD_UPDATE1.convert_to< ::google::protobuf::uint64>());
+    return REWARD_SCHEDULE[period];
+}
 
-    std::string const& getGuid()
-    {
+// wallet balances and amounts on the stack, canonical decimals of up to 76 digits are below 2^255
+// so adding two of them can't overflow; anything else keeps going through cpp_int
+typedef boost::multiprecision::checked_uint256_t Amount;
+
+static const std::size_t AMOUNT_MAX_DIGITS = 76;
+static const Amount TX_FEE_AMOUNT(TX_FEE_STRING);
+
+static bool toAmount(boost::string_ref amount, Amount* value)
+{
+    if (amount.empty() || amount.size() > AMOUNT_MAX_DIGITS || (amount[0] == '0' && amount.size() > 1))
+    {
+        return false;
+    }
+
+    Amount ret = 0;
+    std::size_t pos = 0;
+    std::size_t chunk = amount.size() % 19;
+    if (chunk == 0)
+    {
+        chunk = 19;
+    }
+    while (pos < amount.size())
+    {
+        ::google::protobuf::uint64 part = 0;
+        for (std::size_t end = pos + chunk; pos < end; ++pos)
+        {
+            char c = amount[pos];
+            if (c < '0' || c > '9')
+            {
+                return false;
+            }
+            part = part * 10 + (c - '0');
+        }
+        ret = ret * POW10_19 + part;
+        chunk = 19;
+    }
+    *value = ret;
+    return true;
+}
+
+static std::string toString(Amount value)
+{
+    if (value == 0)
+    {
+        return "0";
+    }
+
+    char digits[80];
+    char* begin = digits + sizeof(digits);
+    Amount quotient;
+    Amount remainder;
+    while (value != 0)
+    {
+        boost::multiprecision::divide_qr(value, Amount(POW10_19), quotient, remainder);
+        ::google::protobuf::uint64 part = remainder.convert_to< ::google::protobuf::uint64>();
+        value = quotient;
+        for (int i = 0; i < 19 && (part != 0 || value != 0); ++i)
+        {
+            *--begin = static_cast<char>('0' + part % 10);
+            part /= 10;
+        }
+    }
+    return std::string(begin, digits + sizeof(digits) - begin);
+}
+
+// toString(getBigint(balance) + delta)
+static std::string addAmounts(std::string const& balance, boost::string_ref deltaString, boost::multiprecision::cpp_int const& delta)
+{
+    Amount balanceValue;
+    Amount deltaValue;
+    if (toAmount(balance, &balanceValue) && toAmount(deltaString, &deltaValue))
+    {
+        return toString(Amount(balanceValue + deltaValue));
+    }
+    return toString(getBigint(balance) + delta);
+}
+
+// toString(getBigint(balance) + getBigint(deltaString))
+static std::string addAmounts(std::string const& balance, std::string const& deltaString)
+{
+    Amount balanceValue;
+    Amount deltaValue;
+    if (toAmount(balance, &balanceValue) && toAmount(deltaString, &deltaValue))
+    {
+        return toString(Amount(balanceValue + deltaValue));
+    }
+    boost::multiprecision::cpp_int ret = getBigint(balance);
+    ret += getBigint(deltaString);
+    return toString(ret);
+}
+
+static std::string compress(std::string const& uncompressed)
+{
+    // uncompressed key is 0x04 + x + y, where x and y are 32 bytes each
+    // to compress we use 0x02 + x if y is even or 0x03 + x if y is odd
+
+    std::string ret;
+
+    std::string marker = uncompressed.substr(0, 2);
+    if (uncompressed.length() == 2 * (1 + 2 * 32) && isHex(uncompressed) && marker == "04")
+    {
+        std::string x = uncompressed.substr(2 * 1, 2 * 32);
+        std::string yLast = uncompressed.substr(2 * (1 + 32 + 31), 2 * 1);
+
+        std::istringstream iss(yLast);
+        unsigned int last;
+        iss >> std::hex >> last;
+        if (!iss.fail() && iss.eof())
+        {
+            if (last % 2)
+            {
+                ret = "03" + x;
+            }
+            else
+            {
+                ret = "02" + x;
+            }
+        }
+    }
+    else if ((marker == "02" || marker == "03") && uncompressed.length() == 66)
+    {
+        return uncompressed;
+    }
+
+    if (!ret.length())
+    {
+        throw sawtooth::InvalidTransaction("Unexpected public key format");
+    }
+
+    return ret;
+}
+
+// signer public key -> sighash, shared by all applicators; signers repeat a lot so this is mostly hits
+class SighashCache
+{
+public:
+    explicit SighashCache(std::size_t capacity): capacity(capacity)
+    {
+    }
+
+    std::string get(std::string const& publicKey)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto found = index.find(publicKey);
+            if (found != index.end())
+            {
+                entries.splice(entries.begin(), entries, found->second);
+                return found->second->second;
+            }
+        }
+
+        std::string sighash = sha512id(compress(publicKey));
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (index.find(publicKey) == index.end())
+        {
+            entries.emplace_front(publicKey, sighash);
+            index[publicKey] = entries.begin();
+            if (entries.size() > capacity)
+            {
+                index.erase(entries.back().first);
+                entries.pop_back();
+            }
+        }
+        return sighash;
+    }
+
+private:
+    typedef std::list<std::pair<std::string, std::string>> Entries;
+
+    std::size_t capacity;
+    std::mutex lock;
+    Entries entries;
+    std::unordered_map<std::string, Entries::iterator> index;
+};
+
+static SighashCache sighashCache(SIGHASH_CACHE_SIZE);
+
+static std::string getFromHeader(nlohmann::json const& block, char const* fieldName)
+{
+    if (block.count(HEADER) != 1)
+    {
+        throw sawtooth::InvalidTransaction(RPC_FAILURE);
+    }
+    auto& header = block[HEADER];
+    if (!header.is_object())
+    {
+        throw sawtooth::InvalidTransaction(RPC_FAILURE);
+    }
+    return header[fieldName];
+}
+
+static std::string blockNum(nlohmann::json const& block)
+{
+    std::string num = getFromHeader(block, BLOCK_NUM);
+    return num;
+}
+
+static boost::multiprecision::cpp_int blockNumInt(nlohmann::json const& block)
+{
+    std::string num = blockNum(block);
+    return getBigint(num);
+}
+
+static const boost::multiprecision::uint512_t INTEREST_FAST_LIMIT = boost::multiprecision::uint512_t(1) << 256;
+
+static boost::multiprecision::cpp_int compoundInterest(boost::multiprecision::cpp_int total, boost::multiprecision::cpp_int ticks, boost::multiprecision::cpp_int const& interest)
+{
+    boost::multiprecision::cpp_int compound;
+    for (; ticks > 0; --ticks)
+    {
+        compound = total * interest;
+        if (compound < INTEREST_MULTIPLIER)
+        {
+            break;
+        }
+        compound /= INTEREST_MULTIPLIER;
+        total += compound;
+    }
+    return total;
+}
+
+// every tick adds floor(total * interest / INTEREST_MULTIPLIER), the rounding makes each step depend on
+// the remainder of the previous one so the ticks can't be collapsed into a power and are still iterated:
+// on 512 bit integers while the total and the interest fit 256 bits, and only until the compound interest
+// rounds down to zero, after which the total can't change anymore
+boost::multiprecision::cpp_int calcInterest(boost::multiprecision::cpp_int const& amount, boost::multiprecision::cpp_int const& ticks, boost::multiprecision::cpp_int const& interest)
+{
+    if (ticks <= 0 || amount == 0 || interest == 0)
+    {
+        return amount;
+    }
+    if (amount >= INTEREST_FAST_LIMIT || interest >= INTEREST_FAST_LIMIT || ticks > std::numeric_limits< ::google::protobuf::uint64>::max())
+    {
+        return compoundInterest(amount, ticks, interest);
+    }
+
+    boost::multiprecision::uint512_t total(amount);
+    const boost::multiprecision::uint512_t rate(interest);
+    boost::multiprecision::uint512_t compound;
+    ::google::protobuf::uint64 remaining = ticks.convert_to< ::google::protobuf::uint64>();
+    while (remaining > 0)
+    {
+        compound = total * rate;
+        if (compound < INTEREST_MULTIPLIER)
+        {
+            break;
+        }
+        compound /= INTEREST_MULTIPLIER;
+        total += compound;
+        --remaining;
+        if (total >= INTEREST_FAST_LIMIT)
+        {
+            return compoundInterest(boost::multiprecision::cpp_int(total), remaining, interest);
+        }
+    }
+    return boost::multiprecision::cpp_int(total);
+}
+
+static bool benchExpiryIndex();
+static bool verifyPayloads();
+static bool verifyRewards();
+
+class Applicator : public sawtooth::TransactionApplicator
+{
+    friend bool benchExpiryIndex();
+    friend bool verifyPayloads();
+    friend bool verifyRewards();
+
+public:
+    Applicator(sawtooth::TransactionUPtr txn, sawtooth::GlobalStateUPtr state) :
+        TransactionApplicator(std::move(txn), std::move(state)), replayMode(ReplayMode::Auto)
+    {
+    };
+
+    void Apply(std::string const& cmd, Params const& query)
+    {
+        if (v2block != 0 && lastBlockInt(ctx) > v2block)
+        {
+            std::string const& version = txn->header()->GetValue(sawtooth::TransactionHeaderField::TransactionHeaderFamilyVersion);
+            if (version[0] == '1')
+                throw sawtooth::InvalidTransaction("Version 1 transactions are not accepted after 2.0");
+        }
+#ifndef NDEBUG
+        {
+            //std::ofstream log("B:\\Job\\gluwa\\prod\\transition.log", std::ios::app);
+            //std::stringstream l;
+            //l << ctx.tip << ": " << ctx.guid << " - " << cmd << "\n";
+            //for (int i = 1; ; ++i)
+            //{
+            //    std::stringstream p;
+            //    p << "p" << i;
+            //    auto pp = p.str();
+            //    auto param = query.find(pp);
+            //    if (param == query.end())
+            //        break;
+            //    l << " " << param->dump();
+            //}
+            //auto ll = l.str();
+            //log << ll;
+            //OutputDebugStringA((ll.c_str());
+        }
+#endif
+        std::size_t slot = verbSlot(cmd.data(), cmd.size(), VERB_SEED);
+        VerbEntry const& entry = VERB_TABLE.slots[slot];
+        if (!entry.verb || !boost::iequals(cmd, entry.verb))
+        {
+            std::stringstream error;
+            error << "invalid command: '" << cmd << "'";
+            throw sawtooth::InvalidTransaction(error.str());
+        }
+
+        // a transaction run ahead of its turn is counted by flushReplay, and only if its result is taken
+        if (ctx.reads)
+        {
+            (this->*entry.handler)(query);
+            return;
+        }
+
+        VerbStats& stats = verbStats[slot];
+        auto started = std::chrono::steady_clock::now();
+        try
+        {
+            (this->*entry.handler)(query);
+        }
+        catch (...)
+        {
+            countVerb(&stats, true, std::chrono::steady_clock::now() - started);
+            throw;
+        }
+        countVerb(&stats, false, std::chrono::steady_clock::now() - started);
+    }
+
+    static void countVerb(VerbStats* stats, bool failed, std::chrono::steady_clock::duration spent)
+    {
+        ++stats->invocations;
+        if (failed)
+            ++stats->failures;
+        stats->microseconds += std::chrono::duration_cast<std::chrono::microseconds>(spent).count();
+    }
+
+    void doApply(std::string const& cmd, Params const& query, std::string const& guid, std::string const& sighash)
+    {
+        ctx.guid = guid;
+        ctx.sighash = sighash;
+
+        Apply(cmd, query);
+
+        commitTransaction(&ctx.currentState);
+    }
+
+    void execute(Tx const& tx, std::set<std::string>* written)
+    {
+        if (tx.payload.size() > 0 && tx.guid.size() > 0)
+        {
+            std::string cmd;
+            Params query;
+            cborToParams(reinterpret_cast<std::uint8_t const*>(tx.payload.data()), tx.payload.size(), &cmd, &query);
+            ctx.replaying = true;
+            ctx.guid = tx.guid.to_string();
+            ctx.sighash = tx.sighash.to_string();
+            Apply(cmd, query);
+            for (auto const& e : ctx.currentState)
+                written->insert(e.first);
+            commitTransaction(&ctx.currentState);
+            ctx.replaying = false;
+        }
+    }
+
+    // a historical transaction to re-execute on top of the block tip, or the end of the block endOfBlock
+    struct ReplayStep
+    {
+        Tx tx;
+        int tip;
+        int endOfBlock;
+    };
+
+    // what a transaction did when it ran ahead of its turn, on the state as it was before the window
+    struct Speculation
+    {
+        Speculation() : serial(false), stats(nullptr), spent()
+        {
+        }
+
+        ReadLog reads;
+        std::map<std::string, std::string> writes;
+        std::exception_ptr error;
+        bool serial;
+        VerbStats* stats;
+        std::chrono::steady_clock::duration spent;
+    };
+
+    // Auto runs a window ahead of turn when there are workers besides the caller, -verifyReplay compares the others
+    enum class ReplayMode
+    {
+        Auto,
+        Serial,
+        Speculative
+    };
+
+    void replay(Tx const& tx, int tip)
+    {
+        if (tx.sighash.size() == 0)
+            return;
+        replaySteps.push_back(ReplayStep{ tx, tip, -1 });
+        if (replaySteps.size() == REPLAY_WINDOW)
+            flushReplay();
+    }
+
+    void replayBlockEnd(int blockIdx)
+    {
+        replaySteps.push_back(ReplayStep{ Tx(), 0, blockIdx });
+        if (replaySteps.size() == REPLAY_WINDOW)
+            flushReplay();
+    }
+
+    // the transactions of a window run ahead of their turn on the worker pool, then are taken in order: one that
+    // read an address or scanned a prefix written by a transaction before it in the window runs again, the others'
+    // writes are taken as they are. Replaying a block on top of the last one doesn't change what a read sees, so a
+    // window goes across blocks. Housekeeping reads the signers of blocks besides state and always runs in turn
+    void flushReplay()
+    {
+        std::vector<ReplayStep> steps;
+        steps.swap(replaySteps);
+        std::vector<Speculation> speculations(steps.size());
+        if (replayMode == ReplayMode::Speculative || (replayMode == ReplayMode::Auto && workerPool().workers() > 0))
+        {
+            workerPool().run(steps.size(), [this, &steps, &speculations](std::size_t i) {
+                if (steps[i].endOfBlock < 0)
+                    speculate(steps[i], &speculations[i]);
+            });
+        }
+        else
+        {
+            for (auto& speculation : speculations)
+                speculation.serial = true;
+        }
+
+        int tip = ctx.tip;
+        std::set<std::string> written;
+        for (std::size_t i = 0; i < steps.size(); ++i)
+        {
+            if (steps[i].endOfBlock >= 0)
+            {
+                commitBlock();
+                checkpointBlock(steps[i].endOfBlock);
+                continue;
+            }
+            Speculation& speculation = speculations[i];
+            if (speculation.serial || conflicts(speculation.reads, written))
+            {
+                ctx.tip = steps[i].tip;
+                execute(steps[i].tx, &written);
+            }
+            else if (speculation.error)
+            {
+                if (speculation.stats)
+                    countVerb(speculation.stats, true, speculation.spent);
+                std::rethrow_exception(speculation.error);
+            }
+            else
+            {
+                if (speculation.stats)
+                    countVerb(speculation.stats, false, speculation.spent);
+                for (auto& e : speculation.writes)
+                    written.insert(e.first);
+                commitTransaction(&speculation.writes);
+            }
+        }
+        ctx.tip = tip;
+    }
+
+    void speculate(ReplayStep const& step, Speculation* speculation)
+    {
+        Tx const& tx = step.tx;
+        if (tx.payload.size() == 0 || tx.guid.size() == 0)
+            return;
+        std::string cmd;
+        Params query;
+        try
+        {
+            cborToParams(reinterpret_cast<std::uint8_t const*>(tx.payload.data()), tx.payload.size(), &cmd, &query);
+        }
+        catch (...)
+        {
+            speculation->serial = true;
+            return;
+        }
+        if (boost::iequals(cmd, "Housekeeping"))
+        {
+            speculation->serial = true;
+            return;
+        }
+
+        Applicator replica(shareTransaction(), sawtooth::GlobalStateUPtr());
+        replica.ctx.tip = step.tip;
+        replica.ctx.replaying = true;
+        replica.ctx.reads = &speculation->reads;
+        replica.ctx.guid = tx.guid.to_string();
+        replica.ctx.sighash = tx.sighash.to_string();
+        auto started = std::chrono::steady_clock::now();
+        try
+        {
+            replica.Apply(cmd, query);
+        }
+        catch (...)
+        {
+            speculation->error = std::current_exception();
+        }
+        speculation->spent = std::chrono::steady_clock::now() - started;
+        speculation->writes.swap(replica.ctx.currentState);
+        std::size_t slot = verbSlot(cmd.data(), cmd.size(), VERB_SEED);
+        if (VERB_TABLE.slots[slot].verb && boost::iequals(cmd, VERB_TABLE.slots[slot].verb))
+            speculation->stats = &verbStats[slot];
+    }
+
+    static bool conflicts(ReadLog const& reads, std::set<std::string> const& written)
+    {
+        for (auto const& id : reads.addresses)
+        {
+            if (written.count(id))
+                return true;
+        }
+        for (auto const& prefix : reads.prefixes)
+        {
+            auto i = written.lower_bound(prefix);
+            if (i != written.end() && i->compare(0, prefix.size(), prefix) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // the transaction being applied, for a replica that replays history on another thread
+    sawtooth::TransactionUPtr shareTransaction() const
+    {
+        return sawtooth::TransactionUPtr(new sawtooth::Transaction(txn->header(), std::make_shared<std::string>(txn->payload()),
+            std::make_shared<std::string>(txn->signature()), std::make_shared<std::string>(txn->block_signature())));
+    }
+
+    void Apply(std::string const& cmd, Params const& query, std::string const& guid, std::string const& sighash)
+    {
+        if (ctx.transitioning)
+        {
+            std::size_t foundBlockIdx;
+            std::size_t foundTxIdx;
+            if (!blocks.find(guid, &foundBlockIdx, &foundTxIdx))
+            {
+                cleanupTransitioning();
+            }
+            else
+            {
+                int currentBlockIdx = static_cast<int>(foundBlockIdx);
+                int tip = currentBlockIdx - 1;
+                int txIdx = static_cast<int>(foundTxIdx);
+
+                std::lock_guard<std::mutex> guard(stateUpdateLock);
+
+                // a resumed replay asked for a block it has gone past: the state is taken back to the checkpoint and
+                // replayed forward from there, only a block from before the checkpoint needs a replay from genesis
+                if (restoredBlockIdx > 0 && currentBlockIdx < updatedBlockIdx)
+                {
+                    tipCurrentState.clear();
+                    if (currentBlockIdx >= restoredBlockIdx)
+                    {
+                        transitioningState = restoredState;
+                        updatedBlockIdx = restoredBlockIdx;
+                        updatedTxIdx = -1;
+                    }
+                    else
+                    {
+                        LOG4CXX_INFO(logger, "Block " << currentBlockIdx << " is before the replay checkpoint, replaying from the start");
+                        transitioningState = PersistentState();
+                        restoredState = PersistentState();
+                        restoredBlockIdx = 0;
+                        updatedBlockIdx = 0;
+                        updatedTxIdx = blocks.txCount(updatedBlockIdx) - 1;
+                    }
+                }
+
+                if (currentBlockIdx > updatedBlockIdx)
+                {
+                    for (int i = updatedTxIdx + 1; i < blocks.txCount(updatedBlockIdx); ++i)
+                    {
+                        replay(blocks.tx(updatedBlockIdx, i), updatedBlockIdx - 1);
+                    }
+                    replayBlockEnd(updatedBlockIdx);
+                    for (int i = updatedBlockIdx + 1; i < currentBlockIdx; ++i)
+                    {
+                        for (std::size_t j = 0; j < blocks.txCount(i); ++j)
+                        {
+                            replay(blocks.tx(i, j), i - 1);
+                        }
+
+                        replayBlockEnd(i);
+                    }
+
+                    for (int i = 0; i < txIdx; ++i)
+                    {
+                        replay(blocks.tx(updatedBlockIdx, i), tip);
+                    }
+                    ctx.tip = tip;
+                    flushReplay();
+                }
+                else if (currentBlockIdx == updatedBlockIdx)
+                {
+                    ctx.tip = tip;
+                    if (txIdx <= updatedTxIdx)
+                    {
+                        tipCurrentState.clear();
+                        for (int i = 0; i < txIdx; ++i)
+                        {
+                            replay(blocks.tx(updatedBlockIdx, i), tip);
+                        }
+                    }
+                    else
+                    {
+                        for (int i = updatedTxIdx + 1; i < txIdx; ++i)
+                        {
+                            replay(blocks.tx(updatedBlockIdx, i), tip);
+                        }
+                    }
+                    flushReplay();
+                }
+
+                doApply(cmd, query, guid, sighash);
+
+                updatedBlockIdx = currentBlockIdx;
+                updatedTxIdx = txIdx;
+
+                if (updatedBlockIdx == blocks.size() - 1 && updatedTxIdx == blocks.txCount(updatedBlockIdx) - 1)
+                {
+                    std::cout << "Revalidated last block, terminating in a minute" << std::endl;
+                    std::thread(cleanupTransitioning).detach();
+                }
+            }
+            std::lock_guard<std::mutex> guard(killerLock);
+            lastTime = std::chrono::system_clock::now();
+            if (!killerStarted)
+            {
+                std::thread(killer).detach();
+                killerStarted = true;
+            }
+        }
+        else
+        {
+            ctx.sighash = sighash;
+            Apply(cmd, query);
+        }
+    }
+
+    void Apply()
+    {
+        std::cout << "Applicator::Apply" << std::endl;
+
+        std::string cmd;
+        Params query;
+        cborToParams(&cmd, &query);
+        auto nounce = txn->header()->GetValue(sawtooth::TransactionHeaderField::TransactionHeaderNonce);
+        Apply(cmd, query, nounce, sighashCache.get(txn->header()->GetValue(sawtooth::TransactionHeaderField::TransactionHeaderSignerPublicKey)));
+        flushExpiryIndex();
+        flushWrites();
+    }
+
+    // renders a text value the way trimQuotes(value.dump()) does, referring to the payload when nothing needs escaping
+    static void setParam(boost::string_ref text, std::string* storage, boost::string_ref* value)
+    {
+        if (needsEscaping(text))
+        {
+            std::string escaped;
+            escape(text, &escaped);
+            storage->swap(escaped);
+            *value = boost::string_ref(*storage);
+        }
+        else if (storage->data() == text.data())
+        {
+            *value = boost::string_ref(*storage);
+        }
+        else
+        {
+            *value = text;
+        }
+    }
+
+    // the fast path, returns false when the payload has to be decoded by nlohmann::json to get identical results
+    static bool readParams(std::uint8_t const* data, std::size_t size, std::string* cmd, Params* params)
+    {
+        CborReader reader(data, size);
+        if (!reader.atMap())
+        {
+            return false;
+        }
+
+        bool hasVerb = false;
+        std::string verbStorage;
+        boost::string_ref verb;
+
+        bool indefinite;
+        std::uint64_t count = reader.readMapHeader(&indefinite);
+        for (std::uint64_t i = 0; indefinite || i < count; ++i)
+        {
+            if (indefinite && reader.atBreak())
+            {
+                break;
+            }
+            if (!reader.atText())
+            {
+                return false;
+            }
+            std::string keyStorage;
+            boost::string_ref key = reader.readText(&keyStorage);
+
+            int idx = -1;
+            if (key == "v")
+            {
+                idx = PARAM_COUNT;
+            }
+            else
+            {
+                for (int j = 0; j < PARAM_COUNT; ++j)
+                {
+                    if (key == PARAM_KEYS[j])
+                    {
+                        idx = j;
+                        break;
+                    }
+                }
+            }
+
+            if (idx < 0)
+            {
+                reader.skip();
+            }
+            else if (!reader.atText())
+            {
+                // numbers, arrays and the like are rendered through dump()
+                return false;
+            }
+            else if (idx == PARAM_COUNT)
+            {
+                setParam(reader.readText(&verbStorage), &verbStorage, &verb);
+                hasVerb = true;
+            }
+            else
+            {
+                setParam(reader.readText(&params->storage[idx]), &params->storage[idx], &params->values[idx]);
+                params->present[idx] = true;
+            }
+        }
+
+        if (!hasVerb)
+        {
+            throw sawtooth::InvalidTransaction("verb is required");
+        }
+        cmd->assign(verb.data(), verb.size());
+
+        return true;
+    }
+
+    static void domToParams(std::uint8_t const* data, std::size_t size, std::string* cmd, Params* params)
+    {
+        nlohmann::json query = nlohmann::json::from_cbor(std::vector<uint8_t>(data, data + size));
+
+        if (!query.is_object())
+        {
+            throw sawtooth::InvalidTransaction("CBOR Object as the encoded command");
+        }
+
+        auto verb = query.find("v");
+        if (verb == query.end())
+        {
+            throw sawtooth::InvalidTransaction("verb is required");
+        }
+        *cmd = trimQuotes(verb->dump());
+
+        for (int i = 0; i < PARAM_COUNT; ++i)
+        {
+            auto param = query.find(PARAM_KEYS[i]);
+            params->present[i] = param != query.end();
+            if (params->present[i])
+            {
+                params->storage[i] = trimQuotes(param->dump());
+                params->values[i] = boost::string_ref(params->storage[i]);
+            }
+        }
+    }
+
+    static void cborToParams(std::uint8_t const* data, std::size_t size, std::string* cmd, Params* params)
+    {
+        bool read = false;
+        try
+        {
+            read = readParams(data, size, cmd, params);
+        }
+        catch (CborReader::Malformed const&)
+        {
+        }
+
+        if (!read)
+        {
+            for (int i = 0; i < PARAM_COUNT; ++i)
+            {
+                params->present[i] = false;
+            }
+            domToParams(data, size, cmd, params);
+        }
+    }
+
+    void cborToParams(std::string* cmd, Params* params)
+    {
+        const std::string& rawData = txn->payload();
+        cborToParams(reinterpret_cast<std::uint8_t const*>(rawData.data()), rawData.size(), cmd, params);
+    };
+
+    boost::multiprecision::cpp_int lastBlockInt(Ctx const& ctx)
+    {
+        if (ctx.transitioning)
+            return ctx.tip;
+        else
+            return boost::multiprecision::cpp_int(state->GetTip() - 1);
+    }
+
+    std::string lastBlock(Ctx const& ctx)
+    {
+        return toString(lastBlockInt(ctx));
+    }
+
+    template<typename Layer>
+    static bool findState(Layer const& layer, std::string const& id, std::string* stateData)
+    {
+        auto found = layer.find(id);
+        if (found == layer.end())
+            return false;
+        *stateData = found->second;
+        return true;
+    }
+
+    // a read goes through layers of state, newest first, and is answered by the first layer that has
+    // the address. Transitioning, the transaction's own writes, the block being replayed and the
+    // migrated state stand in for the validator, and an address none of them has is empty. Otherwise
+    // the transaction's writes come first, then what it has already read, then the validator.
+    bool getState(sawtooth::GlobalState* state, std::string* stateData, std::string const& id)
+    {
+        if (ctx.transitioning)
+        {
+            if (!findState(ctx.currentState, id, stateData))
+            {
+                if (ctx.reads)
+                    ctx.reads->addresses.push_back(id);
+                if (!findState(tipCurrentState, id, stateData))
+                    transitioningState.find(id, stateData);
+            }
+            return true;
+        }
+
+        auto written = writes.find(id);
+        if (written != writes.end())
+        {
+            *stateData = written->second.value;
+            return !written->second.deleted;
+        }
+        if (findState(readCache, id, stateData))
+            return true;
+        bool found = state->GetState(stateData, id);
+        readCache[id] = *stateData;
+        return found;
+    }
+
+    void write(std::string const& id, std::string const& stateData, bool deleted)
+    {
+        auto inserted = writes.emplace(id, PendingWrite());
+        if (inserted.second)
+            writeOrder.push_back(id);
+        inserted.first->second.value = stateData;
+        inserted.first->second.deleted = deleted;
+    }
+
+    // sends what the transaction wrote as one SetState and one DeleteState request, every address with
+    // its last value; an address ends up either set or deleted, so the order of the two doesn't matter
+    void flushWrites()
+    {
+        std::vector<sawtooth::GlobalState::KeyValue> sets;
+        std::vector<std::string> deletes;
+        for (auto const& id : writeOrder)
+        {
+            PendingWrite const& pending = writes[id];
+            if (pending.deleted)
+                deletes.push_back(id);
+            else
+                sets.push_back(sawtooth::GlobalState::KeyValue(id, pending.value));
+        }
+        writes.clear();
+        writeOrder.clear();
+
+        if (!sets.empty())
+            state->SetState(sets);
+        if (!deletes.empty())
+            state->DeleteState(deletes);
+    }
+
+    // addresses a verb is about to read, anything that isn't a well-formed address is left out so
+    // that declaring a read never fails a transaction
+    struct ReadSet
+    {
+        std::vector<std::string> ids;
+
+        ReadSet& add(StateAddress const& id)
+        {
+            ids.push_back(id.hex());
+            return *this;
+        }
+
+        ReadSet& add(std::string const& id)
+        {
+            if (id.size() == MERKLE_ADDRESS_LENGTH && isHex(id))
+                ids.push_back(id);
+            return *this;
+        }
+
+        ReadSet& addWallet(std::string const& sighash)
+        {
+            return add(namespacePrefix + WALLET + sighash);
+        }
+
+        // an id parameter the way decodeParams will see it
+        ReadSet& addParam(Params const& query, int idx)
+        {
+            std::string id;
+            if (peekId(query, idx, &id))
+                add(id);
+            return *this;
+        }
+
+        static bool peekId(Params const& query, int idx, std::string* id)
+        {
+            if (!query.present[idx - 1])
+                return false;
+            std::string storage;
+            *id = toLower(query.values[idx - 1], &storage).to_string();
+            return true;
+        }
+    };
+
+    // reads the declared addresses with a single GetState round trip, the reads that follow are served
+    // from what came back; if the batch request fails every read goes to the validator on its own
+    void prefetch(ReadSet const& reads)
+    {
+        if (ctx.transitioning)
+            return;
+
+        std::vector<std::string> ids;
+        for (auto const& id : reads.ids)
+        {
+            if (readCache.find(id) == readCache.end() && std::find(ids.begin(), ids.end(), id) == ids.end())
+                ids.push_back(id);
+        }
+        if (ids.empty())
+            return;
+
+        std::unordered_map<std::string, std::string> values;
+        try
+        {
+            state->GetState(&values, ids);
+        }
+        catch (...)
+        {
+            return;
+        }
+        for (auto& id : ids)
+        {
+            auto found = values.find(id);
+            readCache[id] = (found == values.end()) ? std::string() : std::move(found->second);
+        }
+    }
+
+    // the reads of a verb that charges the fee: the wallet of the signer and, with the fee ledger, its entry
+    ReadSet payer(std::string const& sighash)
+    {
+        ReadSet reads;
+        reads.addWallet(sighash);
+        if (feeLedger())
+            reads.add(feeLedgerAddress(lastBlockInt(ctx), sighash));
+        return reads;
+    }
+
+    // what an address held when the transaction read or prefetched it, empty if it hasn't yet
+    std::string const& cachedData(std::string const& id)
+    {
+        static const std::string none;
+        auto found = readCache.find(id);
+        return (found == readCache.end()) ? none : found->second;
+    }
+
+    void setState(sawtooth::GlobalState*, std::vector<sawtooth::GlobalState::KeyValue> const& states)
+    {
+        if (ctx.transitioning)
+        {
+            for (auto i : states)
+            {
+                ctx.currentState[i.first] = i.second;
+#ifndef NDEBUG
+                //std::stringstream s;
+                //s << i.first << ": " << i.second << "\n";
+                //OutputDebugStringA(s.str().c_str());
+#endif
+            }
+        }
+        if (!ctx.replaying)
+        {
+            for (auto const& i : states)
+                write(i.first, i.second, false);
+        }
+    }
+
+    void setState(sawtooth::GlobalState*, std::string const& stateData, std::string const& id)
+    {
+        if (ctx.transitioning)
+        {
+            ctx.currentState[id] = stateData;
+#ifndef NDEBUG
+            //std::stringstream s;
+            //s << id << ": " << stateData << "\n";
+            //OutputDebugStringA(s.str().c_str());
+#endif
+        }
+        if (!ctx.replaying)
+            write(id, stateData, false);
+    }
+
+    void deleteState(sawtooth::GlobalState*, std::string const& id)
+    {
+        if (ctx.transitioning)
+            ctx.currentState[id] = std::string();
+
+        if (!ctx.replaying)
+            write(id, std::string(), true);
+    }
+
+    void setState(sawtooth::GlobalStateUPtr const& state, std::string const& stateData, std::string const& id)
+    {
+        setState(state.get(), id, stateData);
+    }
+
+    void setState(sawtooth::GlobalStateUPtr const& state, std::vector<sawtooth::GlobalState::KeyValue> const& states)
+    {
+        setState(state.get(), states);
+    }
+
+    void deleteState(sawtooth::GlobalStateUPtr const& state, std::string const& id)
+    {
+        deleteState(state.get(), id);
+    }
+
+    std::string getStateData(std::string const& id, bool existing = false)
+    {
+        return getStateData(state.get(), id, existing);
+    }
+
+    std::string getStateData(StateAddress const& id, bool existing = false)
+    {
+        return getStateData(state.get(), id.hex(), existing);
+    }
+
+    std::string getStateData(sawtooth::GlobalState* state, std::string const& id, bool existing = false)
+    {
+        std::string stateData;
+
+        if (!getState(state , &stateData, id))
+        {
+            //The section below is commented out because sawtooth 1.0.5 inconsistently returns either key:None or empty list for the same state query
+            //      when porting to rust make sure that in sawtooth 1.2 that doesn't happen or doesn't have a special meaning
+            //    throw sawtooth::InvalidTransaction("Failed to retrieve the state " + id);
+        }
+
+        if (existing && stateData.empty())
+        {
+            throw sawtooth::InvalidTransaction("Existing state expected " + id);
+        }
+        return stateData;
+    }
+
+    static void addState(std::vector<sawtooth::GlobalState::KeyValue>* states, std::string const& id, google::protobuf::Message const& message)
+    {
+        std::string data;
+        message.SerializeToString(&data);
+        states->push_back(sawtooth::GlobalState::KeyValue(id, data));
+    }
+
+    static void addState(std::vector<sawtooth::GlobalState::KeyValue>* states, StateAddress const& id, google::protobuf::Message const& message)
+    {
+        std::string data;
+        message.SerializeToString(&data);
+        states->push_back(sawtooth::GlobalState::KeyValue(id.hex(), data));
+    }
+
+private:
+    void verifyGatewaySigner()
+    {
+        if (transitioning)
+            return;
+        const std::string mySighash = getSighash();
+        auto actualSettings = settings.load();
+        auto setting = actualSettings->find("sawtooth.gateway.sighash");
+        if (setting == actualSettings->end())
+        {
+            doUpdateSettings();
+            actualSettings = settings.load();
+            setting = actualSettings->find("sawtooth.gateway.sighash");
+            if (setting == actualSettings->end())
+                throw sawtooth::InvalidTransaction("Gateway sighash is not configured");
+        }
+        if (mySighash != setting->second)
+        {
+            throw sawtooth::InvalidTransaction("Only gateway sighash can perform this operation");
+        }
+    }
+
+    void verify(std::stringstream const& gatewayCommand)
+    {
+        if (transitioning)
+            return;
+
+        std::string response = "";
+        try
+        {
+            std::lock_guard<std::mutex> guard(localGatewayLock);
+            if (localGateway->send(gatewayCommand.str()))
+            {
+                localGateway->receive(response);
+            }
+            if (response.empty() || response == "miss") // couldn't interact with the local gateway or it wasn't able to validate
+            {
+                // need to reset the socket here or else it will always fail next time
+                // TODO: need a way to handle the local gateway coming back online and start replying to old messages
+                localGateway->close();
+                delete localGateway;
+                localGateway = new zmqpp::socket(*socketContext, zmqpp::socket_type::request);
+                localGateway->connect(URL_GATEWAY);
+                localGateway->set(zmqpp::socket_option::receive_timeout, LOCAL_SOCKET_TIMEOUT_MILLISECONDS);
+
+                auto address = externalGatewayAddress.load();
+                if (!address->empty())
+                {
+                    externalGateway->connect(*address);
+                    try
+                    {
+                        if (externalGateway->send(gatewayCommand.str()))
+                        {
+                            externalGateway->receive(response);
+                        }
+                    }
+                    catch (...)
+                    {
+                        externalGateway->disconnect(*address);
+                        throw;
+                    }
+                    externalGateway->disconnect(*address);
+                }
+            }
+        }
+        catch (...)
+        {
+            throw;
+        }
+        if (response != "good")
+        {
+            throw sawtooth::InvalidTransaction("Couldn't validate the transaction");
+        }
+    }
+
+    // rewards summed per wallet, in the order the wallets were first rewarded
+    struct Awards
+    {
+        std::vector<std::pair<StateAddress, boost::multiprecision::cpp_int>> totals;
+        std::unordered_map<StateAddress, std::size_t, StateAddressHash> index;
+    };
+
+    static void addAward(Awards* awards, bool newFormula, boost::multiprecision::cpp_int const& blockIdx, StateAddress const& walletId)
+    {
+        BlockReward const& blockReward = newFormula ? scheduledReward(blockIdx) : FIXED_REWARD;
+        if (blockReward.amount > 0)
+        {
+            auto inserted = awards->index.emplace(walletId, awards->totals.size());
+            if (inserted.second)
+            {
+                awards->totals.emplace_back(walletId, blockReward.amount);
+            }
+            else
+            {
+                awards->totals[inserted.first->second].second += blockReward.amount;
+            }
+        }
+    }
+
+    // one wallet update per miner, ends up with the same state as updating it for every block
+    void award(Awards const& awards)
+    {
+        ReadSet reads;
+        for (auto const& total : awards.totals)
+        {
+            reads.add(total.first);
+        }
+        prefetch(reads);
+
+        for (auto const& total : awards.totals)
+        {
+            StateAddress const& walletId = total.first;
+            boost::multiprecision::cpp_int const& reward = total.second;
+            std::string rewardString = toString(reward);
+
+            std::string stateData = getStateData(walletId);
+            Wallet wallet;
+            if (stateData.empty())
+            {
+                wallet.set_amount(rewardString);
+            }
+            else
+            {
+                wallet.ParseFromString(stateData);
+                wallet.set_amount(addAmounts(wallet.amount(), rewardString, reward));
+            }
+            std::vector<sawtooth::GlobalState::KeyValue> states;
+            addState(&states, walletId, wallet);
+            setState(state, states);
+        }
+    }
+
+    void reward(boost::multiprecision::cpp_int const& processedBlockIdx, boost::multiprecision::cpp_int const& uptoBlockIdx)
+    {
+        assert(uptoBlockIdx == 0 || uptoBlockIdx > processedBlockIdx);
+
+        try
+        {
+            bool newFormula = false;
+
+            if (ctx.transitioning)
+            {
+                int setBlock = (ctx.tip >= 278890 && ctx.tip <= 278904) ? 277800 : 278910;
+                boost::multiprecision::cpp_int updateBlock(setBlock);
+                if (updateBlock + 500 < processedBlockIdx)
+                    newFormula = true;
+
+                std::vector<std::string> signers;
+                for (boost::multiprecision::cpp_int i = uptoBlockIdx; i > processedBlockIdx; --i)
+                {
+                    int idx = i.convert_to<int>();
+                    signers.push_back(blocks.signer(idx).to_string());
+                }
+                std::vector<StateAddress> walletIds;
+                makeAddresses(WALLET, signers, &walletIds);
+
+                Awards awards;
+                boost::multiprecision::cpp_int i = uptoBlockIdx;
+                for (auto const& walletId : walletIds)
+                {
+                    addAward(&awards, newFormula, i--, walletId);
+                }
+                award(awards);
+                return;
+            }
+
+            auto actualSettings = settings.load();
+            auto i = actualSettings->find("sawtooth.validator.update1");
+            if (i != actualSettings->end())
+            {
+                std::string updateBlockStr = i->second;
+                boost::multiprecision::cpp_int updateBlock = getBigint(updateBlockStr);
+                if (updateBlock + 500 < processedBlockIdx)
+                    newFormula = true;
+            }
+
+            //TODO: use ClientBlockList insted of ClientBlockGetById to retrieve multiple blocks
+
+            boost::multiprecision::cpp_int const& lastBlockIdx = (uptoBlockIdx == 0) ?
+                processedBlockIdx + BLOCK_REWARD_PROCESSING_COUNT :
+                uptoBlockIdx;
+
+            std::vector<std::string> signers;
+            const std::string* sig = &txn->block_signature();
+            if (sig->empty()) {
+                for (boost::multiprecision::cpp_int i = processedBlockIdx + 1; i <= lastBlockIdx; ++i)
+                {
+                    ::google::protobuf::uint64 height = i.convert_to< ::google::protobuf::uint64>();
+                    std::string signer;
+                    std::lock_guard<std::mutex> guard(contextlessStateLock);
+                    contextlessState->GetSigByNum(height, &signer);
+                    signers.push_back(signer);
+                }
+            } else {
+
+                auto first = lastBlockIdx.convert_to< ::google::protobuf::uint64>();
+                auto last = (processedBlockIdx + 1).convert_to< ::google::protobuf::uint64>();
+                std::lock_guard<std::mutex> guard(contextlessStateLock);
+                contextlessState->GetRewardBlockSignatures(*sig, signers, first, last);
+            }
+
+            std::vector<StateAddress> walletIds;
+            makeAddresses(WALLET, signers, &walletIds);
+
+            {
+                Awards awards;
+                boost::multiprecision::cpp_int i = processedBlockIdx;
+
+                for (auto const& walletId : walletIds)
+                {
+                    addAward(&awards, newFormula, ++i, walletId);
+                }
+                award(awards);
+            }
+        }
+        catch (sawtooth::InvalidTransaction const&)
+        {
+            throw;
+        }
+        catch (...)
+        {
+            throw sawtooth::InvalidTransaction(RPC_FAILURE);
+        }
+    }
+
+    void addFee(std::string const& sighash, std::vector<sawtooth::GlobalState::KeyValue>* states)
+    {
+        if (feeLedger())
+        {
+            states->push_back(feeLedgerEntry(sighash, lastBlockInt(ctx), 1));
+            return;
+        }
+        std::string const& guid = getGuid();
+        const StateAddress feeId = makeAddress(FEE, guid);
+        Fee fee;
+        fee.set_sighash(sighash);
+        fee.set_block(lastBlock(ctx));
+        addState(states, feeId, fee);
+        indexExpiry(feeId, getBigint(fee.block()) + YEAR_OF_BLOCKS + 1);
+    }
+
+    void addFee(std::string const& sighash, std::vector<sawtooth::GlobalState::KeyValue>* states, StateAddress const& walletId, Wallet const& wallet)
+    {
+        addFee(sighash, states);
+        addState(states, walletId, wallet);
+    }
+
+    void indexExpiry(StateAddress const& id, boost::multiprecision::cpp_int const& expiresAt)
+    {
+        if (!ctx.transitioning)
+            expiryChanges[expiryEntry(expiresAt, id)] = ExpiryChange{ id, true };
+    }
+
+    // an order that has been removed or can't expire anymore, it doesn't fail the transaction if the order is malformed
+    void unindexExpiry(std::string const& id, std::string const& block, ::google::protobuf::uint64 expiration)
+    {
+        StateAddress address;
+        if (ctx.transitioning || !parseAddress(id, &address))
+            return;
+        try
+        {
+            expiryChanges[expiryEntry(expiresAt(block, expiration), address)] = ExpiryChange{ address, false };
+        }
+        catch (sawtooth::InvalidTransaction const&)
+        {
+        }
+    }
+
+    // whether a change starting at height is in effect, never while replaying history from before it
+    bool activeAt(boost::multiprecision::cpp_int const& height)
+    {
+        return !ctx.transitioning && height < lastBlockInt(ctx);
+    }
+
+    bool expiryIndexed()
+    {
+        return activeAt(EXPIRY_INDEX_BLOCK);
+    }
+
+    bool feeLedger()
+    {
+        return activeAt(FEE_LEDGER_BLOCK);
+    }
+
+    // the ledger entry of sighash for the bucket of block, with count more fees to refund
+    sawtooth::GlobalState::KeyValue feeLedgerEntry(std::string const& sighash, boost::multiprecision::cpp_int const& block, boost::multiprecision::cpp_int const& count)
+    {
+        std::string id = feeLedgerAddress(block, sighash);
+        std::string stateData = getStateData(id);
+        boost::multiprecision::cpp_int total = count;
+        if (!stateData.empty())
+        {
+            std::string owner;
+            boost::multiprecision::cpp_int paid;
+            decodeFeeLedgerEntry(stateData, &owner, &paid);
+            total += paid;
+        }
+        return sawtooth::GlobalState::KeyValue(id, encodeFeeLedgerEntry(sighash, total));
+    }
+
+    // gives count transaction fees back to the wallet of sighash in one update
+    void refundFees(std::string const& sighash, boost::multiprecision::cpp_int const& count)
+    {
+        const std::string walletId = namespacePrefix + WALLET + sighash;
+        std::string stateData;
+        if (!getState(state.get(), &stateData, walletId) || stateData.empty())
+        {
+            throw sawtooth::InvalidTransaction("Existing state expected " + walletId);
+        }
+        Wallet wallet;
+        wallet.ParseFromString(stateData);
+        boost::multiprecision::cpp_int refund = count * TX_FEE;
+        wallet.set_amount(addAmounts(wallet.amount(), toString(refund), refund));
+
+        wallet.SerializeToString(&stateData);
+        setState(state, walletId, stateData);
+    }
+
+    // refunds the signers in a bucket of the ledger after the entry at *after, all the fees a signer paid in it
+    // with one wallet update and at most *budget of them; true once the bucket is done, *after is the last
+    // entry refunded. Refunded entries are deleted, the ones before *after are only skipped over
+    bool refundFeeLedgerBucket(boost::multiprecision::cpp_int const& bucket, std::string* after, std::size_t* budget)
+    {
+        std::vector<sawtooth::GlobalState::KeyValue> entries;
+        bool done = true;
+        for (auto const& entry : PrefixScan(ctx, feeLedgerPrefix(bucket)))
+        {
+            if (!after->empty() && entry.first <= *after)
+            {
+                continue;
+            }
+            if (entries.size() == *budget)
+            {
+                done = false;
+                break;
+            }
+            entries.push_back(entry);
+        }
+        *budget -= entries.size();
+
+        ReadSet wallets;
+        std::vector<std::pair<std::string, boost::multiprecision::cpp_int>> refunds;
+        for (auto const& entry : entries)
+        {
+            std::string sighash;
+            boost::multiprecision::cpp_int count;
+            decodeFeeLedgerEntry(entry.second, &sighash, &count);
+            wallets.addWallet(sighash);
+            refunds.push_back(std::make_pair(sighash, count));
+        }
+        prefetch(wallets);
+
+        for (std::size_t i = 0; i < entries.size(); ++i)
+        {
+            refundFees(refunds[i].first, refunds[i].second);
+            deleteState(state, entries[i].first);
+        }
+        if (!entries.empty())
+        {
+            *after = entries.back().first;
+        }
+        return done;
+    }
+
+    // how far the ledger has been refunded: the first bucket that isn't done and the last entry refunded in it
+    bool feeLedgerPosition(boost::multiprecision::cpp_int* bucket, std::string* after)
+    {
+        std::string stateData = getStateData(namespacePrefix + PROCESSED_BLOCK + FEE_LEDGER_SWEPT_ID);
+        if (stateData.empty())
+            return false;
+        auto pos = stateData.find(' ');
+        *bucket = getBigint(stateData.substr(0, pos));
+        after->clear();
+        if (pos != std::string::npos)
+            *after = stateData.substr(pos + 1);
+        return true;
+    }
+
+    // refunds the buckets of the fee ledger that have come due at blockIdx, oldest first, at most
+    // HOUSEKEEPING_BATCH_SIZE entries and buckets per transaction when Housekeeping is bounded; a bucket left halfway goes on
+    // after its last refunded entry. Once started it goes on even if the ledger is switched off
+    void sweepFeeLedger(boost::multiprecision::cpp_int const& blockIdx, bool bounded)
+    {
+        const std::string sweptId = namespacePrefix + PROCESSED_BLOCK + FEE_LEDGER_SWEPT_ID;
+        std::string stateData = getStateData(sweptId);
+        boost::multiprecision::cpp_int first = 0;
+        std::string after;
+        if (!feeLedgerPosition(&first, &after))
+        {
+            if (!feeLedger())
+                return;
+            // the ledger starts out empty, the buckets that are due already have nothing to refund
+            if (blockIdx > YEAR_OF_BLOCKS)
+                first = (blockIdx - YEAR_OF_BLOCKS) / FEE_LEDGER_BUCKET_BLOCKS;
+        }
+
+        boost::multiprecision::cpp_int bucket = first;
+        std::size_t budget = bounded ? HOUSEKEEPING_BATCH_SIZE : std::numeric_limits<std::size_t>::max();
+        while (budget > 0 && feeLedgerBucketDue(bucket, blockIdx) && refundFeeLedgerBucket(bucket, &after, &budget))
+        {
+            ++bucket;
+            after.clear();
+            // every bucket is a prefix scan of its own, an empty one counts against the budget too
+            if (budget > 0)
+                --budget;
+        }
+        std::string position = after.empty() ? toString(bucket) : toString(bucket) + " " + after;
+        if (position != stateData)
+        {
+            setState(state, sweptId, position);
+        }
+    }
+
+    // writes the index entries the transaction changed, the ones to remove are read in one round trip as only
+    // those that are there get deleted
+    void flushExpiryIndex()
+    {
+        if (expiryChanges.empty())
+            return;
+        if (!expiryIndexed())
+        {
+            expiryChanges.clear();
+            return;
+        }
+
+        ReadSet reads;
+        for (auto const& change : expiryChanges)
+        {
+            if (!change.second.added)
+                reads.add(change.first);
+        }
+        prefetch(reads);
+
+        for (auto const& change : expiryChanges)
+        {
+            StateAddress const& order = change.second.order;
+            if (change.second.added)
+                setState(state, change.first.hex(), std::string(reinterpret_cast<char const*>(order.bytes), StateAddress::SIZE));
+            else if (!getStateData(change.first).empty())
+                deleteState(state, change.first.hex());
+        }
+        expiryChanges.clear();
+    }
+
+    // how an entry fares when it is swept at blockIdx, worked out from the entry alone so that the entries of a
+    // sweep can be decided on all at once
+    struct Verdict
+    {
+        enum Refund
+        {
+            NO_REFUND,
+            DEAL_ORDER_FEE,
+            TRANSACTION_FEE
+        };
+
+        bool expired;
+        bool expiring;
+        boost::multiprecision::cpp_int expiresAt;
+        Refund refund;
+        std::string sighash;
+        std::string fee;
+        boost::multiprecision::cpp_int paidAt;
+        std::exception_ptr error;
+
+        Verdict() : expired(false), expiring(false), refund(NO_REFUND)
+        {
+        }
+    };
+
+    static void decideAskOrder(Ctx const&, boost::multiprecision::cpp_int const& blockIdx, std::string const& protobuf, Verdict* verdict)
+    {
+        AskOrder askOrder;
+        askOrder.ParseFromString(protobuf);
+        boost::multiprecision::cpp_int start = getBigint(askOrder.block());
+        boost::multiprecision::cpp_int elapsed = blockIdx - start;
+        verdict->expired = askOrder.expiration() < elapsed;
+        verdict->expiring = true;
+        verdict->expiresAt = start + askOrder.expiration() + 1;
+    }
+
+    static void decideBidOrder(Ctx const&, boost::multiprecision::cpp_int const& blockIdx, std::string const& protobuf, Verdict* verdict)
+    {
+        BidOrder bidOrder;
+        bidOrder.ParseFromString(protobuf);
+        boost::multiprecision::cpp_int start = getBigint(bidOrder.block());
+        boost::multiprecision::cpp_int elapsed = blockIdx - start;
+        verdict->expired = bidOrder.expiration() < elapsed;
+        verdict->expiring = true;
+        verdict->expiresAt = start + bidOrder.expiration() + 1;
+    }
+
+    static void decideOffer(Ctx const&, boost::multiprecision::cpp_int const& blockIdx, std::string const& protobuf, Verdict* verdict)
+    {
+        Offer offer;
+        offer.ParseFromString(protobuf);
+        boost::multiprecision::cpp_int start = getBigint(offer.block());
+        boost::multiprecision::cpp_int elapsed = blockIdx - start;
+        verdict->expired = offer.expiration() < elapsed;
+        verdict->expiring = true;
+        verdict->expiresAt = start + offer.expiration() + 1;
+    }
+
+    static void decideDealOrder(Ctx const& ctx, boost::multiprecision::cpp_int const& blockIdx, std::string const& protobuf, Verdict* verdict)
+    {
+        DealOrder dealOrder;
+        dealOrder.ParseFromString(protobuf);
+        boost::multiprecision::cpp_int start = getBigint(dealOrder.block());
+        boost::multiprecision::cpp_int elapsed = blockIdx - start;
+        verdict->expired = dealOrder.expiration() < elapsed && dealOrder.loan_transfer().empty();
+        if (verdict->expired && (!ctx.tip || (ctx.tip && ctx.tip > dealExpFixBlock)))
+        {
+            verdict->refund = Verdict::DEAL_ORDER_FEE;
+            verdict->sighash = dealOrder.sighash();
+            verdict->fee = dealOrder.fee();
+        }
+        verdict->expiring = dealOrder.loan_transfer().empty();
+        verdict->expiresAt = start + dealOrder.expiration() + 1;
+    }
+
+    static void decideRepaymentOrder(Ctx const&, boost::multiprecision::cpp_int const& blockIdx, std::string const& protobuf, Verdict* verdict)
+    {
+        RepaymentOrder repaymentOrder;
+        repaymentOrder.ParseFromString(protobuf);
+        boost::multiprecision::cpp_int start = getBigint(repaymentOrder.block());
+        boost::multiprecision::cpp_int elapsed = blockIdx - start;
+        verdict->expired = repaymentOrder.expiration() < elapsed && repaymentOrder.previous_owner().empty();
+        verdict->expiring = repaymentOrder.previous_owner().empty();
+        verdict->expiresAt = start + repaymentOrder.expiration() + 1;
+    }
+
+    static void decideFee(Ctx const&, boost::multiprecision::cpp_int const& blockIdx, std::string const& protobuf, Verdict* verdict)
+    {
+        Fee fee;
+        fee.ParseFromString(protobuf);
+        boost::multiprecision::cpp_int start(fee.block());
+        boost::multiprecision::cpp_int elapsed = blockIdx - start;
+        verdict->expired = YEAR_OF_BLOCKS < elapsed;
+        if (verdict->expired)
+        {
+            verdict->refund = Verdict::TRANSACTION_FEE;
+        }
+        verdict->sighash = fee.sighash();
+        verdict->paidAt = start;
+        verdict->expiring = true;
+        verdict->expiresAt = start + YEAR_OF_BLOCKS + 1;
+    }
+
+    // works out a verdict, it has no side effects and can run on any thread
+    typedef void (*Decider)(Ctx const& ctx, boost::multiprecision::cpp_int const& blockIdx, std::string const& protobuf, Verdict* verdict);
+
+    struct ExpiringNamespace
+    {
+        char const* prefix;
+        Decider decide;
+    };
+
+    // in the order Housekeeping has always swept them
+    static std::array<ExpiringNamespace, 6> const& expiringNamespaces()
+    {
+        static const std::array<ExpiringNamespace, 6> namespaces = { {
+            { ASK_ORDER, &Applicator::decideAskOrder },
+            { BID_ORDER, &Applicator::decideBidOrder },
+            { OFFER, &Applicator::decideOffer },
+            { DEAL_ORDER, &Applicator::decideDealOrder },
+            { REPAYMENT_ORDER, &Applicator::decideRepaymentOrder },
+            { FEE, &Applicator::decideFee } } };
+        return namespaces;
+    }
+
+    struct Sweeping
+    {
+        Decider decide;
+        std::string address;
+        std::string protobuf;
+        Verdict verdict;
+    };
+
+    // the decoding half of a sweep, a failure is kept for when the entry is expired
+    static void decideOn(Ctx const& ctx, boost::multiprecision::cpp_int const& blockIdx, Sweeping* sweeping)
+    {
+        sweeping->verdict = Verdict();
+        if (sweeping->protobuf.empty())
+            return;
+        try
+        {
+            sweeping->decide(ctx, blockIdx, sweeping->protobuf, &sweeping->verdict);
+        }
+        catch (...)
+        {
+            sweeping->verdict.error = std::current_exception();
+        }
+    }
+
+    // decides on a batch of entries over the worker pool
+    void decideAll(boost::multiprecision::cpp_int const& blockIdx, std::vector<Sweeping>* batch)
+    {
+        Ctx const& context = ctx;
+        workerPool().run(batch->size(), [&context, &blockIdx, batch](std::size_t i) {
+            decideOn(context, blockIdx, &(*batch)[i]);
+        });
+    }
+
+    // the writing half, entries go through it one by one in address order: removes the entry if it has expired,
+    // otherwise tells whether and when it can expire
+    bool expire(std::string const& address, Verdict const& verdict, boost::multiprecision::cpp_int* expiresAt)
+    {
+        if (verdict.error)
+        {
+            std::rethrow_exception(verdict.error);
+        }
+        if (!verdict.expired)
+        {
+            *expiresAt = verdict.expiresAt;
+            return verdict.expiring;
+        }
+
+        if (verdict.refund == Verdict::DEAL_ORDER_FEE)
+        {
+            const std::string walletId = namespacePrefix + WALLET + verdict.sighash;
+            std::string stateData = getStateData(state.get(), walletId, true);
+            Wallet wallet;
+            wallet.ParseFromString(stateData);
+            wallet.set_amount(addAmounts(wallet.amount(), verdict.fee));
+
+            std::vector<sawtooth::GlobalState::KeyValue> states;
+            addState(&states, walletId, wallet);
+            setState(state.get(), states);
+        }
+        else if (verdict.refund == Verdict::TRANSACTION_FEE)
+        {
+            const std::string walletId = namespacePrefix + WALLET + verdict.sighash;
+            std::string stateData;
+            if (!getState(state.get(), &stateData, walletId) || stateData.empty())
+            {
+                throw sawtooth::InvalidTransaction("Existing state expected " + walletId);
+            }
+            Wallet wallet;
+            wallet.ParseFromString(stateData);
+            wallet.set_amount(addAmounts(wallet.amount(), TX_FEE_STRING, TX_FEE));
+
+            wallet.SerializeToString(&stateData);
+            setState(state.get(), walletId, stateData);
+        }
+        deleteState(state, address);
+        return false;
+    }
+
+    // a Fee record from before the ledger goes into the bucket of the block it was paid in, or is refunded right
+    // away when that bucket has come due at sweepIdx already or the ledger sweep has gone past its entry
+    void moveToFeeLedger(std::string const& address, Verdict const& verdict, boost::multiprecision::cpp_int const& sweepIdx)
+    {
+        boost::multiprecision::cpp_int bucket = verdict.paidAt / FEE_LEDGER_BUCKET_BLOCKS;
+        boost::multiprecision::cpp_int sweptBucket;
+        std::string after;
+        bool swept = feeLedgerPosition(&sweptBucket, &after) &&
+            (bucket < sweptBucket || (bucket == sweptBucket && !after.empty() && feeLedgerAddress(verdict.paidAt, verdict.sighash) <= after));
+        if (swept || feeLedgerBucketDue(bucket, sweepIdx))
+        {
+            refundFees(verdict.sighash, 1);
+        }
+        else
+        {
+            auto entry = feeLedgerEntry(verdict.sighash, verdict.paidAt, 1);
+            setState(state, entry.first, entry.second);
+        }
+        deleteState(state, address);
+    }
+
+    // expire(), except that with the ledger on a Fee record goes through it
+    bool settle(Sweeping const& sweeping, bool ledger, boost::multiprecision::cpp_int const& sweepIdx, boost::multiprecision::cpp_int* expiresAt)
+    {
+        if (ledger && sweeping.decide == &Applicator::decideFee && !sweeping.verdict.error)
+        {
+            moveToFeeLedger(sweeping.address, sweeping.verdict, sweepIdx);
+            return false;
+        }
+        return expire(sweeping.address, sweeping.verdict, expiresAt);
+    }
+
+    // reads only the buckets that came due since the last sweep and gives their entries the treatment the
+    // full scan gives them, namespace by namespace in address order
+    void sweepExpired(boost::multiprecision::cpp_int const& swept, boost::multiprecision::cpp_int const& blockIdx, bool ledger)
+    {
+        auto const& namespaces = expiringNamespaces();
+        std::array<StateAddress, 6> prefixes;
+        for (std::size_t i = 0; i < namespaces.size(); ++i)
+        {
+            prefixes[i] = StateAddress::withPrefix(namespaces[i].prefix);
+        }
+
+        struct Due
+        {
+            std::size_t ns;
+            StateAddress entry;
+            StateAddress index;
+
+            bool operator<(Due const& other) const
+            {
+                return ns != other.ns ? ns < other.ns : entry < other.entry;
+            }
+        };
+        std::vector<Due> due;
+        ReadSet entryReads;
+        for (boost::multiprecision::cpp_int bucket = swept / EXPIRY_BUCKET_BLOCKS; bucket <= blockIdx / EXPIRY_BUCKET_BLOCKS; ++bucket)
+        {
+            for (auto const& indexed : PrefixScan(ctx, expiryPrefix(bucket)))
+            {
+                StateAddress index;
+                parseAddress(indexed.first, &index);
+                if (indexed.second.size() != StateAddress::SIZE)
+                {
+                    expiryChanges[index] = ExpiryChange{ StateAddress(), false };
+                    continue;
+                }
+                StateAddress entry;
+                std::memcpy(entry.bytes, indexed.second.data(), StateAddress::SIZE);
+                std::size_t ns = 0;
+                while (ns < prefixes.size() && std::memcmp(entry.bytes, prefixes[ns].bytes, StateAddress::ID_OFFSET) != 0)
+                    ++ns;
+                if (ns == prefixes.size())
+                {
+                    expiryChanges[index] = ExpiryChange{ entry, false };
+                    continue;
+                }
+                due.push_back(Due{ ns, entry, index });
+                entryReads.add(entry);
+            }
+        }
+        prefetch(entryReads);
+
+        std::stable_sort(due.begin(), due.end());
+        std::vector<Sweeping> batch(due.size());
+        for (std::size_t i = 0; i < due.size(); ++i)
+        {
+            batch[i].decide = namespaces[due[i].ns].decide;
+            batch[i].address = due[i].entry.hex();
+            batch[i].protobuf = getStateData(batch[i].address);
+        }
+        decideAll(blockIdx, &batch);
+
+        for (std::size_t i = 0; i < due.size(); ++i)
+        {
+            auto const& d = due[i];
+            Sweeping& sweeping = batch[i];
+            // an entry listed in more than one bucket is decided on again when the sweep has already changed it
+            std::string protobuf = getStateData(sweeping.address);
+            if (protobuf != sweeping.protobuf)
+            {
+                sweeping.protobuf = protobuf;
+                decideOn(ctx, blockIdx, &sweeping);
+            }
+            boost::multiprecision::cpp_int expiresAt;
+            if (protobuf.empty() || !settle(sweeping, ledger, blockIdx, &expiresAt))
+            {
+                expiryChanges[d.index] = ExpiryChange{ d.entry, false };
+            }
+            else if (expiryEntry(expiresAt, d.entry) != d.index)
+            {
+                expiryChanges[d.index] = ExpiryChange{ d.entry, false };
+                expiryChanges[expiryEntry(expiresAt, d.entry)] = ExpiryChange{ d.entry, true };
+            }
+        }
+    }
+
+    StateAddress charge(std::string const& sighash, Wallet* wallet)
+    {
+        const StateAddress walletId = walletAddress(sighash);
+        std::string stateData = getStateData(walletId, true);
+        wallet->ParseFromString(stateData);
+
+        Amount amount;
+        if (toAmount(wallet->amount(), &amount))
+        {
+            if (amount < TX_FEE_AMOUNT)
+            {
+                throw sawtooth::InvalidTransaction("Insufficient funds");
+            }
+            wallet->set_amount(toString(Amount(amount - TX_FEE_AMOUNT)));
+            return walletId;
+        }
+
+        boost::multiprecision::cpp_int balance = getBigint(wallet->amount());
+        if (balance - TX_FEE < 0)
+        {
+            throw sawtooth::InvalidTransaction("Insufficient funds");
+        }
+        wallet->set_amount(toString(balance - TX_FEE));
+
+        return walletId;
+    }
+
+    std::string const& getSighash()
+    {
+        return ctx.sighash;
+    }
+
+    std::string const& getGuid()
+    {
         if (ctx.transitioning)
             return ctx.guid;
         else
-            return txn->header()->GetValue(sawtooth::TransactionHeaderField::TransactionHeaderNonce);
+            return txn->header()->GetValue(sawtooth::TransactionHeaderField::TransactionHeaderNonce);
+    }
+
+
+public: //TODO: tmp, remove 'public', ctx should be private
+    Ctx ctx;
+    ReplayMode replayMode;
+
+private:
+    // state the transaction has read or prefetched from the validator, shadowed by its own writes
+    std::unordered_map<std::string, std::string> readCache;
+
+    struct PendingWrite
+    {
+        std::string value;
+        bool deleted;
+    };
+
+    // writes of the transaction, held until it has been applied successfully
+    std::unordered_map<std::string, PendingWrite> writes;
+    std::vector<std::string> writeOrder;
+
+    // historical transactions and block ends waiting to be replayed as a window
+    std::vector<ReplayStep> replaySteps;
+
+    struct ExpiryChange
+    {
+        StateAddress order;
+        bool added;
+    };
+
+    // expiry index updates of the transaction by index entry, the last one made to an entry wins
+    std::map<StateAddress, ExpiryChange> expiryChanges;
+
+    void SendFunds(Params const& query)
+    {
+        Args<2> args;
+        decodeParams(query, SEND_FUNDS_PARAMS, &args);
+        boost::multiprecision::cpp_int const& amount = args[0].bigint;
+        const std::string amountString = args[0].str();
+        const std::string sighash = args[1].str();
+
+        const std::string mySighash = getSighash();
+        if (sighash == mySighash)
+        {
+            throw sawtooth::InvalidTransaction("Invalid destination");
+        }
+
+        const StateAddress srcWalletId = walletAddress(mySighash);
+        const std::string dstWalletId = namespacePrefix + WALLET + sighash;
+        prefetch(payer(mySighash).add(dstWalletId));
+
+        std::string stateData = getStateData(srcWalletId, true);
+
+        Wallet srcWallet;
+        srcWallet.ParseFromString(stateData);
+        Amount srcAmount;
+        Amount sentAmount;
+        if (toAmount(srcWallet.amount(), &srcAmount) && toAmount(args[0].text, &sentAmount))
+        {
+            Amount amountPlusTxFee = sentAmount + TX_FEE_AMOUNT;
+            if (srcAmount < amountPlusTxFee)
+            {
+                throw sawtooth::InvalidTransaction("Insufficient funds");
+            }
+            srcWallet.set_amount(toString(Amount(srcAmount - amountPlusTxFee)));
+        }
+        else
+        {
+            boost::multiprecision::cpp_int amountPlusTxFee = amount + TX_FEE;
+            boost::multiprecision::cpp_int srcBalance = getBigint(srcWallet.amount());
+            if (srcBalance < amountPlusTxFee)
+            {
+                throw sawtooth::InvalidTransaction("Insufficient funds");
+            }
+
+            srcBalance -= amountPlusTxFee;
+            srcWallet.set_amount(toString(srcBalance));
+        }
+
+        stateData = getStateData(dstWalletId);
+
+        Wallet dstWallet;
+        if (stateData.empty())
+        {
+            dstWallet.set_amount(amountString);
+        }
+        else
+        {
+            dstWallet.ParseFromString(stateData);
+            dstWallet.set_amount(addAmounts(dstWallet.amount(), args[0].text, amount));
+        }
+
+        std::vector<sawtooth::GlobalState::KeyValue> states;
+        addState(&states, dstWalletId, dstWallet);
+        addFee(mySighash, &states, srcWalletId, srcWallet);
+        setState(state, states);
+    }
+
+    void RegisterAddress(Params const& query)
+    {
+        Args<3> args;
+        decodeParams(query, REGISTER_ADDRESS_PARAMS, &args);
+        const std::string blockchain = args[0].str();
+        const std::string addressString = args[1].str();
+        const std::string network = args[2].str();
+        std::string addressStringLower = addressString;
+        boost::to_lower(addressStringLower);
+
+        const std::string mySighash = getSighash();
+        const StateAddress id = makeAddress(ADDR, blockchain + addressStringLower + network);
+        prefetch(payer(mySighash).add(id));
+
+        Wallet wallet;
+        StateAddress walletId = charge(mySighash, &wallet);
+
+        std::string stateData = getStateData(id);
+        if (!stateData.empty())
+        {
+            throw sawtooth::InvalidTransaction("The address has been already registered");
+        }
+
+        Address address;
+        address.set_blockchain(blockchain);
+        address.set_value(addressString);
+        address.set_network(network);
+        address.set_sighash(mySighash);
+
+        std::vector<sawtooth::GlobalState::KeyValue> states;
+        addState(&states, id, address);
+        addState(&states, walletId, wallet);
+        addFee(mySighash, &states);
+        setState(state, states);
+    }
+
+    void RegisterTransfer(Params const& query)
+    {
+        const std::string mySighash = getSighash();
+        prefetch(payer(mySighash).addParam(query, 2));
+
+        Wallet wallet;
+        StateAddress walletId = charge(mySighash, &wallet);
+
+        Args<3> args;
+        decodeParams(query, REGISTER_TRANSFER_PARAMS, &args);
+        std::string gainString = args[0].str();
+        boost::multiprecision::cpp_int const& gain = args[0].bigint;
+        const std::string orderId = args[1].str();
+        const std::string blockchainTxId = args[2].str();
+
+        std::string srcAddressId;
+        std::string dstAddressId;
+        std::string amountString;
+
+        std::string stateData = getStateData(orderId, true);
+        if (boost::starts_with(orderId, namespacePrefix + DEAL_ORDER))
+        {
+            DealOrder order;
+            order.ParseFromString(stateData);
+            if (gain == 0)
+            {
+                srcAddressId = order.src_address();
+                dstAddressId = order.dst_address();
+            }
+            else
+            {
+                dstAddressId = order.src_address();
+                srcAddressId = order.dst_address();
+            }
+            amountString = order.amount();
+        }
+        else if (boost::starts_with(orderId, namespacePrefix + REPAYMENT_ORDER))
+        {
+            if (gain != 0)
+            {
+                throw sawtooth::InvalidTransaction("gain must be 0 for repayment orders");
+            }
+            RepaymentOrder order;
+            order.ParseFromString(stateData);
+            srcAddressId = order.src_address();
+            dstAddressId = order.dst_address();
+            amountString = order.amount();
+        }
+        else
+        {
+            throw sawtooth::InvalidTransaction("unexpected referred order");
+        }
+
+        prefetch(ReadSet().add(srcAddressId).add(dstAddressId));
+        stateData = getStateData(srcAddressId, true);
+        Address srcAddress;
+        srcAddress.ParseFromString(stateData);
+        stateData = getStateData(dstAddressId, true);
+        Address dstAddress;
+        dstAddress.ParseFromString(stateData);
+
+        if (srcAddress.sighash() != mySighash)
+        {
+            throw sawtooth::InvalidTransaction("Only the owner can register");
+        }
+        const std::string blockchain = srcAddress.blockchain();
+        if (dstAddress.blockchain() != blockchain)
+        {
+            throw sawtooth::InvalidTransaction("Source and destination addresses must be on the same blockchain");
+        }
+
+        const std::string network = srcAddress.network();
+        if (dstAddress.network() != network)
+        {
+            throw sawtooth::InvalidTransaction("Source and destination addresses must be on the same network");
+        }
+
+        const StateAddress transferId = makeAddress(TRANSFER, blockchain + blockchainTxId + network);
+        stateData = getStateData(transferId);
+        if (!stateData.empty())
+        {
+            throw sawtooth::InvalidTransaction("The transfer has been already registered");
+        }
+
+        if (blockchainTxId == "0")
+        {
+            amountString = "0";
+        }
+        else
+        {
+            boost::multiprecision::cpp_int amount = getBigint(amountString);
+            amount = amount + gain;
+            amountString = toString(amount);
+
+            std::stringstream gatewayCommand;
+            gatewayCommand << blockchain << " verify " << srcAddress.value() << " " << dstAddress.value() << " " << orderId << " " << amountString << " " << blockchainTxId << " " << network;
+            verify(gatewayCommand);
+        }
+
+        Transfer transfer;
+        transfer.set_blockchain(blockchain);
+        transfer.set_src_address(srcAddressId);
+        transfer.set_dst_address(dstAddressId);
+        transfer.set_order(orderId);
+        transfer.set_amount(amountString);
+        transfer.set_tx(blockchainTxId);
+        transfer.set_block(lastBlock(ctx));
+        transfer.set_processed(false);
+        transfer.set_sighash(mySighash);
+
+        std::vector<sawtooth::GlobalState::KeyValue> states;
+        addState(&states, transferId, transfer);
+        addFee(mySighash, &states, walletId, wallet);
+        setState(state, states);
+    }
+
+    void AddAskOrder(Params const& query)
+    {
+        const std::string mySighash = getSighash();
+        prefetch(payer(mySighash).add(makeAddress(ASK_ORDER, getGuid())).addParam(query, 1));
+
+        Wallet wallet;
+        StateAddress walletId = charge(mySighash, &wallet);
+
+        Args<6> args;
+        decodeParams(query, ORDER_PARAMS, &args);
+        const std::string addressId = args[0].str();
+        const std::string amountString = args[1].str();
+        const std::string interest = args[2].str();
+        const std::string maturity = args[3].str();
+        const std::string fee = args[4].str();
+        const ::google::protobuf::uint64 expiration = args[5].number;
+
+        std::string const& guid = getGuid();
+        const StateAddress id = makeAddress(ASK_ORDER, guid);
+        std::string stateData = getStateData(id);
+        if (!stateData.empty())
+        {
+            throw sawtooth::InvalidTransaction("Duplicate id");
+        }
+
+        stateData = getStateData(addressId, true);
+        Address address;
+        address.ParseFromString(stateData);
+        if (address.sighash() != mySighash)
+        {
+            throw sawtooth::InvalidTransaction("The address doesn't belong to the party");
+        }
+
+        AskOrder askOrder;
+        askOrder.set_blockchain(address.blockchain());
+        askOrder.set_address(addressId);
+        askOrder.set_amount(amountString);
+        askOrder.set_interest(interest);
+        askOrder.set_maturity(maturity);
+        askOrder.set_fee(fee);
+        askOrder.set_expiration(expiration);
+        askOrder.set_block(lastBlock(ctx));
+        askOrder.set_sighash(mySighash);
+        indexExpiry(id, expiresAt(askOrder.block(), expiration));
+
+        std::vector<sawtooth::GlobalState::KeyValue> states;
+        addState(&states, id, askOrder);
+        addFee(mySighash, &states, walletId, wallet);
+        setState(state, states);
+    }
+
+    void AddBidOrder(Params const& query)
+    {
+        const std::string mySighash = getSighash();
+        prefetch(payer(mySighash).add(makeAddress(BID_ORDER, getGuid())).addParam(query, 1));
+
+        Wallet wallet;
+        StateAddress walletId = charge(mySighash, &wallet);
+
+        Args<6> args;
+        decodeParams(query, ORDER_PARAMS, &args);
+        const std::string addressId = args[0].str();
+        const std::string amountString = args[1].str();
+        const std::string interest = args[2].str();
+        const std::string maturity = args[3].str();
+        const std::string fee = args[4].str();
+        const ::google::protobuf::uint64 expiration = args[5].number;
+
+        std::string const& guid = getGuid();
+        const StateAddress id = makeAddress(BID_ORDER, guid);
+        std::string stateData = getStateData(id);
+        if (!stateData.empty())
+        {
+            throw sawtooth::InvalidTransaction("Duplicate id");
+        }
+
+        stateData = getStateData(addressId, true);
+        Address address;
+        address.ParseFromString(stateData);
+        if (address.sighash() != mySighash)
+        {
+            throw sawtooth::InvalidTransaction("The address doesn't belong to the party");
+        }
+
+        BidOrder bidOrder;
+        bidOrder.set_blockchain(address.blockchain());
+        bidOrder.set_address(addressId);
+        bidOrder.set_amount(amountString);
+        bidOrder.set_interest(interest);
+        bidOrder.set_maturity(maturity);
+        bidOrder.set_fee(fee);
+        bidOrder.set_expiration(expiration);
+        bidOrder.set_block(lastBlock(ctx));
+        bidOrder.set_sighash(mySighash);
+        indexExpiry(id, expiresAt(bidOrder.block(), expiration));
+
+        std::vector<sawtooth::GlobalState::KeyValue> states;
+        addState(&states, id, bidOrder);
+        addFee(mySighash, &states, walletId, wallet);
+        setState(state, states);
     }
 
+    void AddOffer(Params const& query)
+    {
+        const std::string mySighash = getSighash();
+        {
+            ReadSet reads = payer(mySighash);
+            reads.addParam(query, 1).addParam(query, 2);
+            std::string askOrderId;
+            std::string bidOrderId;
+            if (ReadSet::peekId(query, 1, &askOrderId) && ReadSet::peekId(query, 2, &bidOrderId))
+                reads.add(makeAddress(OFFER, askOrderId + bidOrderId));
+            prefetch(reads);
+        }
 
-public: //TODO: tmp, remove 'public', ctx should be private
-    Ctx ctx;
+        Wallet wallet;
+        StateAddress walletId = charge(mySighash, &wallet);
 
-private:
-    void SendFunds(nlohmann::json const& query)
-    {
-        boost::multiprecision::cpp_int amount;
-        const std::string amountString = getBigint(query, "p1", "amount", &amount);
-        const std::string sighash = getStringLower(query, "p2", "sighash");
+        Args<3> args;
+        decodeParams(query, ADD_OFFER_PARAMS, &args);
+        const std::string askOrderId = args[0].str();
+        const std::string bidOrderId = args[1].str();
+        const ::google::protobuf::uint64 expiration = args[2].number;
 
-        const std::string mySighash = getSighash();
-        if (sighash == mySighash)
+        const StateAddress id = makeAddress(OFFER, askOrderId + bidOrderId);
+        std::string stateData = getStateData(id);
+        if (!stateData.empty())
         {
-            throw sawtooth::InvalidTransaction("Invalid destination");
+            throw sawtooth::InvalidTransaction("Duplicate id");
         }
 
-        const std::string srcWalletId = namespacePrefix + WALLET + mySighash;
-        std::string stateData = getStateData(srcWalletId, true);
+        stateData = getStateData(askOrderId, true);
+        AskOrder askOrder;
+        askOrder.ParseFromString(stateData);
+        if (askOrder.sighash() != mySighash)
+        {
+            throw sawtooth::InvalidTransaction("Only an investor can add an offer");
+        }
+        boost::multiprecision::cpp_int head = lastBlockInt(ctx);
+        boost::multiprecision::cpp_int start = getBigint(askOrder.block());
+        boost::multiprecision::cpp_int elapsed = head - start;
+        if (askOrder.expiration() < elapsed)
+        {
+            throw sawtooth::InvalidTransaction("The order has expired");
+        }
 
-        Wallet srcWallet;
-        srcWallet.ParseFromString(stateData);
-        boost::multiprecision::cpp_int amountPlusTxFee = amount + TX_FEE;
-        boost::multiprecision::cpp_int srcBalance = getBigint(srcWallet.amount());
-        if (srcBalance < amountPlusTxFee)
         {
-            throw sawtooth::InvalidTransaction("Insufficient funds");
+            BidOrder declared;
+            declared.ParseFromString(cachedData(bidOrderId));
+            prefetch(ReadSet().add(askOrder.address()).add(declared.address()));
         }
 
-        srcBalance -= amountPlusTxFee;
-        srcWallet.set_amount(toString(srcBalance));
+        stateData = getStateData(askOrder.address(), true);
+        Address srcAddress;
+        srcAddress.ParseFromString(stateData);
 
-        const std::string dstWalletId = namespacePrefix + WALLET + sighash;
-        stateData = getStateData(dstWalletId);
+        stateData = getStateData(bidOrderId, true);
+        BidOrder bidOrder;
+        bidOrder.ParseFromString(stateData);
+        if (bidOrder.sighash() == mySighash)
+        {
+            throw sawtooth::InvalidTransaction("The ask and bid orders are from the same party");
+        }
+        start = getBigint(bidOrder.block());
+        elapsed = head - start;
+        if (bidOrder.expiration() < elapsed)
+        {
+            throw sawtooth::InvalidTransaction("The order has expired");
+        }
 
-        Wallet dstWallet;
-        if (stateData.empty())
+        stateData = getStateData(bidOrder.address(), true);
+        Address dstAddress;
+        dstAddress.ParseFromString(stateData);
+
+        if (srcAddress.blockchain() != dstAddress.blockchain() || srcAddress.network() != dstAddress.network())
         {
-            dstWallet.set_amount(amountString);
+            throw sawtooth::InvalidTransaction("The ask and bid orders must be on the same blockchain and network");
         }
-        else
+
+        if (askOrder.amount() != bidOrder.amount() || askOrder.fee() > bidOrder.fee() || getBigint(askOrder.interest()) / getBigint(askOrder.maturity()) > getBigint(bidOrder.interest()) / getBigint(bidOrder.maturity()))
         {
-            dstWallet.ParseFromString(stateData);
-            boost::multiprecision::cpp_int dstBalance = getBigint(dstWallet.amount());
-            dstBalance += amount;
-            dstWallet.set_amount(toString(dstBalance));
+            throw sawtooth::InvalidTransaction("The ask and bid orders do not match");
         }
 
+        Offer offer;
+        offer.set_blockchain(srcAddress.blockchain());
+        offer.set_ask_order(askOrderId);
+        offer.set_bid_order(bidOrderId);
+        offer.set_expiration(expiration);
+        offer.set_block(lastBlock(ctx));
+        offer.set_sighash(mySighash);
+        indexExpiry(id, expiresAt(offer.block(), expiration));
+
         std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, dstWalletId, dstWallet);
-        addFee(mySighash, &states, srcWalletId, srcWallet);
+        states.push_back(sawtooth::GlobalState::KeyValue(id.hex(), stateData));
+        addState(&states, id, offer);
+        addFee(mySighash, &states, walletId, wallet);
         setState(state, states);
     }
 
-    void RegisterAddress(nlohmann::json const& query)
+    void AddDealOrder(Params const& query)
     {
-        const std::string blockchain = getStringLower(query, "p1", "blockchain");
-        const std::string addressString = getString(query, "p2", "address");
-        const std::string network = getStringLower(query, "p3", "network");
-        std::string addressStringLower = addressString;
-        boost::to_lower(addressStringLower);
+        Args<2> args;
+        decodeParams(query, ADD_DEAL_ORDER_PARAMS, &args);
+        const std::string offerId = args[0].str();
+        const ::google::protobuf::uint64 expiration = args[1].number;
 
+        const StateAddress id = makeAddress(DEAL_ORDER, offerId);
         const std::string mySighash = getSighash();
-
-        Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
-
-        const std::string id = makeAddress(ADDR, blockchain + addressStringLower + network);
+        prefetch(payer(mySighash).add(id).add(offerId));
 
         std::string stateData = getStateData(id);
         if (!stateData.empty())
         {
-            throw sawtooth::InvalidTransaction("The address has been already registered");
+            throw sawtooth::InvalidTransaction("Duplicate id");
         }
 
-        Address address;
-        address.set_blockchain(blockchain);
-        address.set_value(addressString);
-        address.set_network(network);
-        address.set_sighash(mySighash);
+        stateData = getStateData(offerId, true);
+        Offer offer;
+        offer.ParseFromString(stateData);
+        boost::multiprecision::cpp_int head = lastBlockInt(ctx);
+        boost::multiprecision::cpp_int start = getBigint(offer.block());
+        boost::multiprecision::cpp_int elapsed = head - start;
+        if (offer.expiration() < elapsed)
+        {
+            throw sawtooth::InvalidTransaction("The order has expired");
+        }
+
+        prefetch(ReadSet().add(offer.bid_order()).add(offer.ask_order()));
+        stateData = getStateData(offer.bid_order(), true);
+        BidOrder bidOrder;
+        bidOrder.ParseFromString(stateData);
+        if (bidOrder.sighash() != mySighash)
+        {
+            throw sawtooth::InvalidTransaction("Only a fundraiser can add a deal order");
+        }
+        stateData = getStateData(offer.ask_order(), true);
+        AskOrder askOrder;
+        askOrder.ParseFromString(stateData);
+
+        const StateAddress walletId = walletAddress(mySighash);
+        stateData = getStateData(walletId, true);
+
+        Wallet wallet;
+        wallet.ParseFromString(stateData);
+        boost::multiprecision::cpp_int balance = getBigint(wallet.amount());
+        boost::multiprecision::cpp_int fee = getBigint(bidOrder.fee()) + TX_FEE;
+        if (balance < fee)
+        {
+            throw sawtooth::InvalidTransaction("Insufficient funds");
+        }
+        balance -= fee;
+        wallet.set_amount(toString(balance));
+
+        DealOrder dealOrder;
+        dealOrder.set_blockchain(offer.blockchain());
+        dealOrder.set_src_address(askOrder.address());
+        dealOrder.set_dst_address(bidOrder.address());
+        dealOrder.set_amount(bidOrder.amount());
+        dealOrder.set_interest(bidOrder.interest());
+        dealOrder.set_maturity(bidOrder.maturity());
+        dealOrder.set_fee(bidOrder.fee());
+        dealOrder.set_expiration(expiration);
+        dealOrder.set_block(lastBlock(ctx));
+        dealOrder.set_sighash(mySighash);
+        indexExpiry(id, expiresAt(dealOrder.block(), expiration));
+        unindexExpiry(offer.ask_order(), askOrder.block(), askOrder.expiration());
+        unindexExpiry(offer.bid_order(), bidOrder.block(), bidOrder.expiration());
+        unindexExpiry(offerId, offer.block(), offer.expiration());
 
         std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, id, address);
-        addState(&states, walletId, wallet);
-        addFee(mySighash, &states);
+        addState(&states, id, dealOrder);
+        addFee(mySighash, &states, walletId, wallet);
         setState(state, states);
+        deleteState(state, offer.ask_order());
+        deleteState(state, offer.bid_order());
+        deleteState(state, offerId);
     }
 
-    void RegisterTransfer(nlohmann::json const& query)
+    void CompleteDealOrder(Params const& query)
     {
+        Args<2> args;
+        decodeParams(query, DEAL_ORDER_TRANSFER_PARAMS, &args);
+        const std::string dealOrderId = args[0].str();
+        const std::string transferId = args[1].str();
+
         const std::string mySighash = getSighash();
-        Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
+        prefetch(payer(mySighash).add(dealOrderId).add(transferId));
 
-        std::string gainString = getString(query, "p1", "gain");
-        boost::multiprecision::cpp_int gain = getBigint(gainString, true);
-        const std::string orderId = getStringLower(query, "p2", "orderId");
-        const std::string blockchainTxId = getStringLower(query, "p3", "blockchainTxId");
+        std::string stateData = getStateData(dealOrderId, true);
+        DealOrder dealOrder;
+        dealOrder.ParseFromString(stateData);
+        if (!dealOrder.loan_transfer().empty())
+        {
+            throw sawtooth::InvalidTransaction("The deal has been already completed");
+        }
 
-        std::string srcAddressId;
-        std::string dstAddressId;
-        std::string amountString;
+        stateData = getStateData(dealOrder.src_address(), true);
+        Address srcAddress;
+        srcAddress.ParseFromString(stateData);
+        if (srcAddress.sighash() != mySighash)
+        {
+            throw sawtooth::InvalidTransaction("Only an investor can complete a deal");
+        }
+        boost::multiprecision::cpp_int head = lastBlockInt(ctx);
+        boost::multiprecision::cpp_int start = getBigint(dealOrder.block());
+        boost::multiprecision::cpp_int elapsed = head - start;
+        if (dealOrder.expiration() < elapsed)
+        {
+            throw sawtooth::InvalidTransaction("The order has expired");
+        }
 
-        std::string stateData = getStateData(orderId, true);
-        if (boost::starts_with(orderId, namespacePrefix + DEAL_ORDER))
+        stateData = getStateData(transferId, true);
+        Transfer transfer;
+        transfer.ParseFromString(stateData);
+
+        if (transfer.order() != dealOrderId || transfer.amount() != dealOrder.amount())
         {
-            DealOrder order;
-            order.ParseFromString(stateData);
-            if (gain == 0)
-            {
-                srcAddressId = order.src_address();
-                dstAddressId = order.dst_address();
-            }
-            else
-            {
-                dstAddressId = order.src_address();
-                srcAddressId = order.dst_address();
-            }
-            amountString = order.amount();
+            throw sawtooth::InvalidTransaction("The transfer doesn't match the deal order");
         }
-        else if (boost::starts_with(orderId, namespacePrefix + REPAYMENT_ORDER))
+        if (transfer.sighash() != mySighash)
         {
-            if (gain != 0)
-            {
-                throw sawtooth::InvalidTransaction("gain must be 0 for repayment orders");
-            }
-            RepaymentOrder order;
-            order.ParseFromString(stateData);
-            srcAddressId = order.src_address();
-            dstAddressId = order.dst_address();
-            amountString = order.amount();
+            throw sawtooth::InvalidTransaction("The transfer doesn't match the signer");
         }
-        else
+        if (transfer.processed())
         {
-            throw sawtooth::InvalidTransaction("unexpected referred order");
+            throw sawtooth::InvalidTransaction("The transfer has been already processed");
         }
+        transfer.set_processed(true);
 
-        stateData = getStateData(srcAddressId, true);
-        Address srcAddress;
-        srcAddress.ParseFromString(stateData);
-        stateData = getStateData(dstAddressId, true);
-        Address dstAddress;
-        dstAddress.ParseFromString(stateData);
+        const StateAddress walletId = walletAddress(mySighash);
+        stateData = getStateData(walletId, true);
 
-        if (srcAddress.sighash() != mySighash)
+        boost::multiprecision::cpp_int fee = getBigint(dealOrder.fee()) - TX_FEE;
+
+        Wallet wallet;
+        if (stateData.empty())
         {
-            throw sawtooth::InvalidTransaction("Only the owner can register");
+            if (fee < 0)
+            {
+                throw sawtooth::InvalidTransaction("Insufficient funds");
+            }
+            wallet.set_amount(toString(fee));
         }
-        const std::string blockchain = srcAddress.blockchain();
-        if (dstAddress.blockchain() != blockchain)
+        else
         {
-            throw sawtooth::InvalidTransaction("Source and destination addresses must be on the same blockchain");
+            wallet.ParseFromString(stateData);
+            boost::multiprecision::cpp_int balance = getBigint(wallet.amount());
+            if (balance + fee < 0)
+            {
+                throw sawtooth::InvalidTransaction("Insufficient funds");
+            }
+            balance += fee;
+            wallet.set_amount(toString(balance));
         }
 
-        const std::string network = srcAddress.network();
-        if (dstAddress.network() != network)
-        {
-            throw sawtooth::InvalidTransaction("Source and destination addresses must be on the same network");
-        }
+        unindexExpiry(dealOrderId, dealOrder.block(), dealOrder.expiration());
+        dealOrder.set_loan_transfer(transferId);
+        dealOrder.set_block(lastBlock(ctx));
+
+        std::vector<sawtooth::GlobalState::KeyValue> states;
+        addState(&states, dealOrderId, dealOrder);
+        addState(&states, transferId, transfer);
+        addFee(mySighash, &states, walletId, wallet);
+        setState(state, states);
+    }
+
+    void LockDealOrder(Params const& query)
+    {
+        const std::string mySighash = getSighash();
+        prefetch(payer(mySighash).addParam(query, 1));
+
+        Wallet wallet;
+        StateAddress walletId = charge(mySighash, &wallet);
+
+        Args<1> args;
+        decodeParams(query, LOCK_DEAL_ORDER_PARAMS, &args);
+        const std::string dealOrderId = args[0].str();
 
-        const std::string transferId = makeAddress(TRANSFER, blockchain + blockchainTxId + network);
-        stateData = getStateData(transferId);
-        if (!stateData.empty())
+        std::string stateData = getStateData(dealOrderId, true);
+        DealOrder dealOrder;
+        dealOrder.ParseFromString(stateData);
+        if (!dealOrder.lock().empty())
         {
-            throw sawtooth::InvalidTransaction("The transfer has been already registered");
+            throw sawtooth::InvalidTransaction("The deal has been already locked");
         }
 
-        if (blockchainTxId == "0")
+        if (dealOrder.loan_transfer().empty())
         {
-            amountString = "0";
+            throw sawtooth::InvalidTransaction("The deal has not been completed yet");
         }
-        else
-        {
-            boost::multiprecision::cpp_int amount = getBigint(amountString);
-            amount = amount + gain;
-            amountString = toString(amount);
 
-            std::stringstream gatewayCommand;
-            gatewayCommand << blockchain << " verify " << srcAddress.value() << " " << dstAddress.value() << " " << orderId << " " << amountString << " " << blockchainTxId << " " << network;
-            verify(gatewayCommand);
+        if (mySighash != dealOrder.sighash())
+        {
+            throw sawtooth::InvalidTransaction("Only a fundraiser can lock a deal");
         }
 
-        Transfer transfer;
-        transfer.set_blockchain(blockchain);
-        transfer.set_src_address(srcAddressId);
-        transfer.set_dst_address(dstAddressId);
-        transfer.set_order(orderId);
-        transfer.set_amount(amountString);
-        transfer.set_tx(blockchainTxId);
-        transfer.set_block(lastBlock(ctx));
-        transfer.set_processed(false);
-        transfer.set_sighash(mySighash);
+        dealOrder.set_lock(mySighash);
 
         std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, transferId, transfer);
+        addState(&states, dealOrderId, dealOrder);
         addFee(mySighash, &states, walletId, wallet);
         setState(state, states);
     }
 
-    void AddAskOrder(nlohmann::json const& query)
+    void CloseDealOrder(Params const& query)
     {
         const std::string mySighash = getSighash();
+        prefetch(payer(mySighash).addParam(query, 1).addParam(query, 2));
         Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
+        StateAddress walletId = charge(mySighash, &wallet);
 
-        const std::string addressId = getStringLower(query, "p1", "addressId");
-        const std::string amountString = getBigint(query, "p2", "amount");
-        const std::string interest = getBigint(query, "p3", "interest");
-        const std::string maturity = getBigint(query, "p4", "maturity");
-        const std::string fee = getBigint(query, "p5", "fee");
-        const ::google::protobuf::uint64 expiration = getUint64(query, "p6", "expiration");
+        Args<2> args;
+        decodeParams(query, DEAL_ORDER_TRANSFER_PARAMS, &args);
+        const std::string dealOrderId = args[0].str();
+        const std::string transferId = args[1].str();
 
-        std::string const& guid = getGuid();
-        const std::string id = makeAddress(ASK_ORDER, guid);
-        std::string stateData = getStateData(id);
-        if (!stateData.empty())
+        std::string stateData = getStateData(dealOrderId, true);
+        DealOrder dealOrder;
+        dealOrder.ParseFromString(stateData);
+        if (!dealOrder.repayment_transfer().empty())
         {
-            throw sawtooth::InvalidTransaction("Duplicate id");
+            throw sawtooth::InvalidTransaction("The deal has been already closed");
         }
 
-        stateData = getStateData(addressId, true);
-        Address address;
-        address.ParseFromString(stateData);
-        if (address.sighash() != mySighash)
+        if (mySighash != dealOrder.sighash())
         {
-            throw sawtooth::InvalidTransaction("The address doesn't belong to the party");
+            throw sawtooth::InvalidTransaction("Only a fundraiser can close a deal");
         }
 
-        AskOrder askOrder;
-        askOrder.set_blockchain(address.blockchain());
-        askOrder.set_address(addressId);
-        askOrder.set_amount(amountString);
-        askOrder.set_interest(interest);
-        askOrder.set_maturity(maturity);
-        askOrder.set_fee(fee);
-        askOrder.set_expiration(expiration);
-        askOrder.set_block(lastBlock(ctx));
-        askOrder.set_sighash(mySighash);
+        if (dealOrder.lock() != mySighash)
+        {
+            throw sawtooth::InvalidTransaction("The deal must be locked first");
+        }
+
+        stateData = getStateData(transferId, true);
+        Transfer repaymentTransfer;
+        repaymentTransfer.ParseFromString(stateData);
+
+        if (repaymentTransfer.order() != dealOrderId)
+        {
+            throw sawtooth::InvalidTransaction("The transfer doesn't match the order");
+        }
+        if (repaymentTransfer.sighash() != mySighash)
+        {
+            throw sawtooth::InvalidTransaction("The transfer doesn't match the signer");
+        }
+        if (repaymentTransfer.processed())
+        {
+            throw sawtooth::InvalidTransaction("The transfer has been already processed");
+        }
+        repaymentTransfer.set_processed(true);
+
+        stateData = getStateData(dealOrder.loan_transfer(), true);
+        Transfer loanTransfer;
+        loanTransfer.ParseFromString(stateData);
+
+        boost::multiprecision::cpp_int head = lastBlockInt(ctx);
+        boost::multiprecision::cpp_int start = getBigint(loanTransfer.block());
+        boost::multiprecision::cpp_int maturity = getBigint(dealOrder.maturity());
+
+        boost::multiprecision::cpp_int ticks = ((head - start) + maturity) / maturity;
+        boost::multiprecision::cpp_int amount = calcInterest(getBigint(dealOrder.amount()), ticks, getBigint(dealOrder.interest()));
+        if (getBigint(repaymentTransfer.amount()) < amount)
+        {
+            throw sawtooth::InvalidTransaction("The transfer doesn't match the order");
+        }
+
+        dealOrder.set_repayment_transfer(transferId);
 
         std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, id, askOrder);
+        addState(&states, dealOrderId, dealOrder);
+        addState(&states, transferId, repaymentTransfer);
         addFee(mySighash, &states, walletId, wallet);
         setState(state, states);
     }
 
-    void AddBidOrder(nlohmann::json const& query)
+    void Exempt(Params const& query)
     {
         const std::string mySighash = getSighash();
+        prefetch(payer(mySighash).addParam(query, 1).addParam(query, 2));
         Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
+        StateAddress walletId = charge(mySighash, &wallet);
 
-        const std::string addressId = getStringLower(query, "p1", "addressId");
-        const std::string amountString = getBigint(query, "p2", "amount");
-        const std::string interest = getBigint(query, "p3", "interest");
-        const std::string maturity = getBigint(query, "p4", "maturity");
-        const std::string fee = getBigint(query, "p5", "fee");
-        const ::google::protobuf::uint64 expiration = getUint64(query, "p6", "expiration");
+        Args<2> args;
+        decodeParams(query, DEAL_ORDER_TRANSFER_PARAMS, &args);
+        const std::string dealOrderId = args[0].str();
+        const std::string transferId = args[1].str();
 
-        std::string const& guid = getGuid();
-        const std::string id = makeAddress(BID_ORDER, guid);
-        std::string stateData = getStateData(id);
-        if (!stateData.empty())
+        std::string stateData = getStateData(dealOrderId, true);
+        DealOrder dealOrder;
+        dealOrder.ParseFromString(stateData);
+        if (!dealOrder.repayment_transfer().empty())
         {
-            throw sawtooth::InvalidTransaction("Duplicate id");
+            throw sawtooth::InvalidTransaction("The deal has been already closed");
         }
 
-        stateData = getStateData(addressId, true);
+        stateData = getStateData(transferId, true);
+        Transfer transfer;
+        transfer.ParseFromString(stateData);
+
+        if (transfer.order() != dealOrderId)
+        {
+            throw sawtooth::InvalidTransaction("The transfer doesn't match the order");
+        }
+        if (transfer.processed())
+        {
+            throw sawtooth::InvalidTransaction("The transfer has been already processed");
+        }
+        transfer.set_processed(true);
+
+        stateData = getStateData(dealOrder.src_address(), true);
         Address address;
         address.ParseFromString(stateData);
-        if (address.sighash() != mySighash)
+
+        if (mySighash != address.sighash())
         {
-            throw sawtooth::InvalidTransaction("The address doesn't belong to the party");
+            throw sawtooth::InvalidTransaction("Only an investor can exempt a deal");
         }
 
-        BidOrder bidOrder;
-        bidOrder.set_blockchain(address.blockchain());
-        bidOrder.set_address(addressId);
-        bidOrder.set_amount(amountString);
-        bidOrder.set_interest(interest);
-        bidOrder.set_maturity(maturity);
-        bidOrder.set_fee(fee);
-        bidOrder.set_expiration(expiration);
-        bidOrder.set_block(lastBlock(ctx));
-        bidOrder.set_sighash(mySighash);
+        dealOrder.set_repayment_transfer(transferId);
 
         std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, id, bidOrder);
+        addState(&states, dealOrderId, dealOrder);
+        addState(&states, transferId, transfer);
         addFee(mySighash, &states, walletId, wallet);
         setState(state, states);
     }
 
-    void AddOffer(nlohmann::json const& query)
+    void AddRepaymentOrder(Params const& query)
     {
         const std::string mySighash = getSighash();
+        prefetch(payer(mySighash).add(makeAddress(REPAYMENT_ORDER, getGuid())).addParam(query, 1).addParam(query, 2));
         Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
+        StateAddress walletId = charge(mySighash, &wallet);
 
-        const std::string askOrderId = getStringLower(query, "p1", "askOrderId");
-        const std::string bidOrderId = getStringLower(query, "p2", "bidOrderId");
-        const ::google::protobuf::uint64 expiration = getUint64(query, "p3", "expiration");
+        Args<4> args;
+        decodeParams(query, ADD_REPAYMENT_ORDER_PARAMS, &args);
+        const std::string dealOrderId = args[0].str();
+        const std::string addressId = args[1].str();
+        const std::string amount = args[2].str();
+        const ::google::protobuf::uint64 expiration = args[3].number;
+
+        std::string const& guid = getGuid();
 
-        const std::string id = makeAddress(OFFER, askOrderId + bidOrderId);
+        const StateAddress id = makeAddress(REPAYMENT_ORDER, guid);
         std::string stateData = getStateData(id);
         if (!stateData.empty())
         {
-            throw sawtooth::InvalidTransaction("Duplicate id");
+            throw sawtooth::InvalidTransaction("Duplicated id");
         }
 
-        stateData = getStateData(askOrderId, true);
-        AskOrder askOrder;
-        askOrder.ParseFromString(stateData);
-        if (askOrder.sighash() != mySighash)
+        stateData = getStateData(dealOrderId);
+        DealOrder dealOrder;
+        dealOrder.ParseFromString(stateData);
+        if (dealOrder.sighash() == mySighash)
         {
-            throw sawtooth::InvalidTransaction("Only an investor can add an offer");
+            throw sawtooth::InvalidTransaction("Fundraisers cannot create repayment orders");
         }
-        boost::multiprecision::cpp_int head = lastBlockInt(ctx);
-        boost::multiprecision::cpp_int start = getBigint(askOrder.block());
-        boost::multiprecision::cpp_int elapsed = head - start;
-        if (askOrder.expiration() < elapsed)
+        if (dealOrder.loan_transfer().empty() || !dealOrder.repayment_transfer().empty())
         {
-            throw sawtooth::InvalidTransaction("The order has expired");
+            throw sawtooth::InvalidTransaction("A repayment order can be created only for a deal with an active loan");
         }
 
-        stateData = getStateData(askOrder.address(), true);
+        stateData = getStateData(dealOrder.src_address());
         Address srcAddress;
         srcAddress.ParseFromString(stateData);
-
-        stateData = getStateData(bidOrderId, true);
-        BidOrder bidOrder;
-        bidOrder.ParseFromString(stateData);
-        if (bidOrder.sighash() == mySighash)
-        {
-            throw sawtooth::InvalidTransaction("The ask and bid orders are from the same party");
-        }
-        start = getBigint(bidOrder.block());
-        elapsed = head - start;
-        if (bidOrder.expiration() < elapsed)
+        if (srcAddress.sighash() == mySighash)
         {
-            throw sawtooth::InvalidTransaction("The order has expired");
+            throw sawtooth::InvalidTransaction("Investors cannot create repayment orders");
         }
 
-        stateData = getStateData(bidOrder.address(), true);
-        Address dstAddress;
-        dstAddress.ParseFromString(stateData);
-
-        if (srcAddress.blockchain() != dstAddress.blockchain() || srcAddress.network() != dstAddress.network())
-        {
-            throw sawtooth::InvalidTransaction("The ask and bid orders must be on the same blockchain and network");
-        }
+        stateData = getStateData(addressId);
+        Address newAddress;
+        newAddress.ParseFromString(stateData);
 
-        if (askOrder.amount() != bidOrder.amount() || askOrder.fee() > bidOrder.fee() || getBigint(askOrder.interest()) / getBigint(askOrder.maturity()) > getBigint(bidOrder.interest()) / getBigint(bidOrder.maturity()))
+        if (srcAddress.blockchain() != newAddress.blockchain() || srcAddress.network() != newAddress.network() || srcAddress.value() == newAddress.value())
         {
-            throw sawtooth::InvalidTransaction("The ask and bid orders do not match");
+            throw sawtooth::InvalidTransaction("Invalid address");
         }
 
-        Offer offer;
-        offer.set_blockchain(srcAddress.blockchain());
-        offer.set_ask_order(askOrderId);
-        offer.set_bid_order(bidOrderId);
-        offer.set_expiration(expiration);
-        offer.set_block(lastBlock(ctx));
-        offer.set_sighash(mySighash);
+        RepaymentOrder repaymentOrder;
+        repaymentOrder.set_blockchain(srcAddress.blockchain());
+        repaymentOrder.set_src_address(addressId);
+        repaymentOrder.set_dst_address(dealOrder.src_address());
+        repaymentOrder.set_amount(amount);
+        repaymentOrder.set_expiration(expiration);
+        repaymentOrder.set_block(lastBlock(ctx));
+        repaymentOrder.set_deal(dealOrderId);
+        repaymentOrder.set_sighash(mySighash);
+        indexExpiry(id, expiresAt(repaymentOrder.block(), expiration));
 
         std::vector<sawtooth::GlobalState::KeyValue> states;
-        states.push_back(sawtooth::GlobalState::KeyValue(id, stateData));
-        addState(&states, id, offer);
+        addState(&states, id, repaymentOrder);
         addFee(mySighash, &states, walletId, wallet);
         setState(state, states);
     }
 
-    void AddDealOrder(nlohmann::json const& query)
+    void CompleteRepaymentOrder(Params const& query)
     {
-        const std::string offerId = getStringLower(query, "p1", "offerId");
-        const ::google::protobuf::uint64 expiration = getUint64(query, "p2", "expiration");
-
-        const std::string id = makeAddress(DEAL_ORDER, offerId);
-        std::string stateData = getStateData(id);
-        if (!stateData.empty())
-        {
-            throw sawtooth::InvalidTransaction("Duplicate id");
-        }
-
         const std::string mySighash = getSighash();
+        prefetch(payer(mySighash).addParam(query, 1));
+        Wallet wallet;
+        StateAddress walletId = charge(mySighash, &wallet);
 
-        stateData = getStateData(offerId, true);
-        Offer offer;
-        offer.ParseFromString(stateData);
-        boost::multiprecision::cpp_int head = lastBlockInt(ctx);
-        boost::multiprecision::cpp_int start = getBigint(offer.block());
-        boost::multiprecision::cpp_int elapsed = head - start;
-        if (offer.expiration() < elapsed)
-        {
-            throw sawtooth::InvalidTransaction("The order has expired");
-        }
+        Args<1> args;
+        decodeParams(query, COMPLETE_REPAYMENT_ORDER_PARAMS, &args);
+        const std::string repaymentOrderId = args[0].str();
 
-        stateData = getStateData(offer.bid_order(), true);
-        BidOrder bidOrder;
-        bidOrder.ParseFromString(stateData);
-        if (bidOrder.sighash() != mySighash)
+        std::string stateData = getStateData(repaymentOrderId, true);
+        RepaymentOrder repaymentOrder;
+        repaymentOrder.ParseFromString(stateData);
+
+        prefetch(ReadSet().add(repaymentOrder.dst_address()).add(repaymentOrder.deal()));
+        stateData = getStateData(repaymentOrder.dst_address(), true);
+        Address address;
+        address.ParseFromString(stateData);
+        if (address.sighash() != mySighash)
         {
-            throw sawtooth::InvalidTransaction("Only a fundraiser can add a deal order");
+            throw sawtooth::InvalidTransaction("Only an investor can complete a repayment order");
         }
-        stateData = getStateData(offer.ask_order(), true);
-        AskOrder askOrder;
-        askOrder.ParseFromString(stateData);
-
-        const std::string walletId = namespacePrefix + WALLET + mySighash;
-        stateData = getStateData(walletId, true);
 
-        Wallet wallet;
-        wallet.ParseFromString(stateData);
-        boost::multiprecision::cpp_int balance = getBigint(wallet.amount());
-        boost::multiprecision::cpp_int fee = getBigint(bidOrder.fee()) + TX_FEE;
-        if (balance < fee)
+        stateData = getStateData(repaymentOrder.deal(), true);
+        DealOrder dealOrder;
+        dealOrder.ParseFromString(stateData);
+        if (!dealOrder.lock().empty())
         {
-            throw sawtooth::InvalidTransaction("Insufficient funds");
+            throw sawtooth::InvalidTransaction("The deal has been already locked");
         }
-        balance -= fee;
-        wallet.set_amount(toString(balance));
 
-        DealOrder dealOrder;
-        dealOrder.set_blockchain(offer.blockchain());
-        dealOrder.set_src_address(askOrder.address());
-        dealOrder.set_dst_address(bidOrder.address());
-        dealOrder.set_amount(bidOrder.amount());
-        dealOrder.set_interest(bidOrder.interest());
-        dealOrder.set_maturity(bidOrder.maturity());
-        dealOrder.set_fee(bidOrder.fee());
-        dealOrder.set_expiration(expiration);
-        dealOrder.set_block(lastBlock(ctx));
-        dealOrder.set_sighash(mySighash);
+        unindexExpiry(repaymentOrderId, repaymentOrder.block(), repaymentOrder.expiration());
+        repaymentOrder.set_previous_owner(mySighash);
+        dealOrder.set_lock(mySighash);
 
         std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, id, dealOrder);
+        addState(&states, repaymentOrderId, repaymentOrder);
+        addState(&states, repaymentOrder.deal(), dealOrder);
         addFee(mySighash, &states, walletId, wallet);
         setState(state, states);
-        deleteState(state, offer.ask_order());
-        deleteState(state, offer.bid_order());
-        deleteState(state, offerId);
     }
 
-    void CompleteDealOrder(nlohmann::json const& query)
+    void CloseRepaymentOrder(Params const& query)
     {
-        const std::string dealOrderId = getStringLower(query, "p1", "dealOrderId");
-        const std::string transferId = getStringLower(query, "p2", "transferId");
-
         const std::string mySighash = getSighash();
+        prefetch(payer(mySighash).addParam(query, 1).addParam(query, 2));
+        Wallet wallet;
+        StateAddress walletId = charge(mySighash, &wallet);
 
-        std::string stateData = getStateData(dealOrderId, true);
-        DealOrder dealOrder;
-        dealOrder.ParseFromString(stateData);
-        if (!dealOrder.loan_transfer().empty())
-        {
-            throw sawtooth::InvalidTransaction("The deal has been already completed");
-        }
+        Args<2> args;
+        decodeParams(query, CLOSE_REPAYMENT_ORDER_PARAMS, &args);
+        const std::string repaymentOrderId = args[0].str();
+        const std::string transferId = args[1].str();
 
-        stateData = getStateData(dealOrder.src_address(), true);
-        Address srcAddress;
-        srcAddress.ParseFromString(stateData);
-        if (srcAddress.sighash() != mySighash)
-        {
-            throw sawtooth::InvalidTransaction("Only an investor can complete a deal");
-        }
-        boost::multiprecision::cpp_int head = lastBlockInt(ctx);
-        boost::multiprecision::cpp_int start = getBigint(dealOrder.block());
-        boost::multiprecision::cpp_int elapsed = head - start;
-        if (dealOrder.expiration() < elapsed)
+        std::string stateData = getStateData(repaymentOrderId, true);
+        RepaymentOrder repaymentOrder;
+        repaymentOrder.ParseFromString(stateData);
+        if (repaymentOrder.sighash() != mySighash)
         {
-            throw sawtooth::InvalidTransaction("The order has expired");
+            throw sawtooth::InvalidTransaction("Only a collector can close a repayment order");
         }
 
         stateData = getStateData(transferId, true);
         Transfer transfer;
         transfer.ParseFromString(stateData);
 
-        if (transfer.order() != dealOrderId || transfer.amount() != dealOrder.amount())
+        if (transfer.order() != repaymentOrderId || transfer.amount() != repaymentOrder.amount())
         {
-            throw sawtooth::InvalidTransaction("The transfer doesn't match the deal order");
+            throw sawtooth::InvalidTransaction("The transfer doesn't match the order");
         }
         if (transfer.sighash() != mySighash)
         {
@@ -1899,562 +5246,1304 @@ private:
         }
         transfer.set_processed(true);
 
-        const std::string walletId = namespacePrefix + WALLET + mySighash;
-        stateData = getStateData(walletId, true);
-
-        boost::multiprecision::cpp_int fee = getBigint(dealOrder.fee()) - TX_FEE;
-
-        Wallet wallet;
-        if (stateData.empty())
-        {
-            if (fee < 0)
-            {
-                throw sawtooth::InvalidTransaction("Insufficient funds");
-            }
-            wallet.set_amount(toString(fee));
-        }
-        else
+        stateData = getStateData(repaymentOrder.deal(), true);
+        DealOrder dealOrder;
+        dealOrder.ParseFromString(stateData);
+        stateData = getStateData(dealOrder.src_address(), true);
+        Address srcAddress;
+        srcAddress.ParseFromString(stateData);
+        if (dealOrder.lock() != srcAddress.sighash())
         {
-            wallet.ParseFromString(stateData);
-            boost::multiprecision::cpp_int balance = getBigint(wallet.amount());
-            if (balance + fee < 0)
-            {
-                throw sawtooth::InvalidTransaction("Insufficient funds");
-            }
-            balance += fee;
-            wallet.set_amount(toString(balance));
+            throw sawtooth::InvalidTransaction("The deal must be locked");
         }
 
-        dealOrder.set_loan_transfer(transferId);
-        dealOrder.set_block(lastBlock(ctx));
+        dealOrder.set_src_address(repaymentOrder.src_address());
+        dealOrder.set_lock("");
+        repaymentOrder.set_transfer(transferId);
 
         std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, dealOrderId, dealOrder);
+        addState(&states, repaymentOrderId, repaymentOrder);
+        addState(&states, repaymentOrder.deal(), dealOrder);
         addState(&states, transferId, transfer);
         addFee(mySighash, &states, walletId, wallet);
         setState(state, states);
     }
 
-    void LockDealOrder(nlohmann::json const& query)
+    void CollectCoins(Params const& query)
     {
+        Args<3> args;
+        decodeParams(query, COLLECT_COINS_PARAMS, &args);
+        const std::string ethAddress = args[0].str();
+        boost::multiprecision::cpp_int const& amount = args[1].bigint;
+        const std::string amountString = args[1].str();
+        const std::string blockchainTxId = args[2].str();
+
+        const StateAddress id = makeAddress(ERC20, blockchainTxId);
         const std::string mySighash = getSighash();
+        prefetch(ReadSet().add(id).addWallet(mySighash));
 
-        Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
-
-        const std::string dealOrderId = getStringLower(query, "p1", "dealOrderId");
-
-        std::string stateData = getStateData(dealOrderId, true);
-        DealOrder dealOrder;
-        dealOrder.ParseFromString(stateData);
-        if (!dealOrder.lock().empty())
+        std::string stateData = getStateData(id);
+        if (!stateData.empty())
         {
-            throw sawtooth::InvalidTransaction("The deal has been already locked");
+            throw sawtooth::InvalidTransaction("Already collected");
         }
 
-        if (dealOrder.loan_transfer().empty())
+        std::stringstream gatewayCommand;
+        gatewayCommand << "ethereum verify " << ethAddress << " creditcoin " << mySighash << " " << amountString << " " << blockchainTxId << " unused";
+        verify(gatewayCommand);
+
+        const StateAddress walletId = walletAddress(mySighash);
+        stateData = getStateData(walletId);
+
+        Wallet wallet;
+        if (stateData.empty())
         {
-            throw sawtooth::InvalidTransaction("The deal has not been completed yet");
+            wallet.set_amount(amountString);
         }
-
-        if (mySighash != dealOrder.sighash())
+        else
         {
-            throw sawtooth::InvalidTransaction("Only a fundraiser can lock a deal");
+            wallet.ParseFromString(stateData);
+            wallet.set_amount(addAmounts(wallet.amount(), args[1].text, amount));
         }
 
-        dealOrder.set_lock(mySighash);
-
         std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, dealOrderId, dealOrder);
-        addFee(mySighash, &states, walletId, wallet);
+        addState(&states, walletId, wallet);
+        states.push_back(sawtooth::GlobalState::KeyValue(id.hex(), amountString));
         setState(state, states);
     }
 
-    void CloseDealOrder(nlohmann::json const& query)
+    void Housekeeping(Params const& query)
     {
-        const std::string mySighash = getSighash();
-        Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
+        Args<1> args;
+        decodeParams(query, HOUSEKEEPING_PARAMS, &args);
+        boost::multiprecision::cpp_int const& blockIdx = args[0].bigint;
 
-        const std::string dealOrderId = getStringLower(query, "p1", "dealOrderId");
-        const std::string transferId = getStringLower(query, "p2", "transferId");
+        const std::string processedBlockIdx = namespacePrefix + PROCESSED_BLOCK + PROCESSED_BLOCK_ID;
+        std::string stateData = getStateData(processedBlockIdx);
+        boost::multiprecision::cpp_int lastProcessedBlockIdx = 0;
+        if (!stateData.empty())
+        {
+            lastProcessedBlockIdx = getBigint(stateData);
+        }
 
-        std::string stateData = getStateData(dealOrderId, true);
-        DealOrder dealOrder;
-        dealOrder.ParseFromString(stateData);
-        if (!dealOrder.repayment_transfer().empty())
+        if (blockIdx == 0)
         {
-            throw sawtooth::InvalidTransaction("The deal has been already closed");
+            boost::multiprecision::cpp_int head = lastBlockInt(ctx);
+            if (lastProcessedBlockIdx + CONFIRMATION_COUNT * 2 + BLOCK_REWARD_PROCESSING_COUNT < head)
+            {
+                reward(lastProcessedBlockIdx, 0);
+                setState(state, processedBlockIdx, toString(lastProcessedBlockIdx + BLOCK_REWARD_PROCESSING_COUNT));
+            }
+            return;
         }
 
-        if (mySighash != dealOrder.sighash())
+        verifyGatewaySigner();
+
+        if (blockIdx < CONFIRMATION_COUNT * 2 || blockIdx <= lastProcessedBlockIdx)
         {
-            throw sawtooth::InvalidTransaction("Only a fundraiser can close a deal");
+            return;
         }
 
-        if (dealOrder.lock() != mySighash)
+        boost::multiprecision::cpp_int tip = lastBlockInt(ctx);
+        if (blockIdx >= tip - CONFIRMATION_COUNT)
         {
-            throw sawtooth::InvalidTransaction("The deal must be locked first");
+            LOG4CXX_INFO(logger, "Premature processing");
+            return;
         }
 
-        stateData = getStateData(transferId, true);
-        Transfer repaymentTransfer;
-        repaymentTransfer.ParseFromString(stateData);
+        const std::string sweptBlockIdx = namespacePrefix + PROCESSED_BLOCK + EXPIRY_SWEPT_ID;
+        const std::string cursorId = namespacePrefix + PROCESSED_BLOCK + HOUSEKEEPING_CURSOR_ID;
+        const std::string ledgerVersionId = namespacePrefix + PROCESSED_BLOCK + FEE_LEDGER_VERSION_ID;
+        bool indexed = expiryIndexed();
+        bool bounded = activeAt(BOUNDED_HOUSEKEEPING_BLOCK);
+        bool ledger = feeLedger();
+        prefetch(ReadSet().add(sweptBlockIdx).add(cursorId).add(ledgerVersionId).add(namespacePrefix + PROCESSED_BLOCK + FEE_LEDGER_SWEPT_ID));
+        stateData = getStateData(sweptBlockIdx);
+        std::string cursor = getStateData(cursorId);
+        boost::multiprecision::cpp_int sweepIdx = blockIdx;
 
-        if (repaymentTransfer.order() != dealOrderId)
+        // with the ledger the first full scan moves the Fee records into it and later scans leave the FEE namespace
+        // alone; switching the ledger off brings the Fee records and their scans back
+        std::string ledgerVersion = getStateData(ledgerVersionId);
+        bool migrated = ledger && ledgerVersion == FEE_LEDGER_VERSION;
+        if (!ledger && !ledgerVersion.empty())
         {
-            throw sawtooth::InvalidTransaction("The transfer doesn't match the order");
+            deleteState(state, ledgerVersionId);
         }
-        if (repaymentTransfer.sighash() != mySighash)
+        sweepFeeLedger(blockIdx, bounded);
+
+        if (indexed && !stateData.empty())
         {
-            throw sawtooth::InvalidTransaction("The transfer doesn't match the signer");
+            sweepExpired(getBigint(stateData), blockIdx, ledger);
+            setState(state, sweptBlockIdx, toString(blockIdx));
+            // a scan left unfinished when the index took over
+            if (!cursor.empty())
+            {
+                deleteState(state, cursorId);
+            }
         }
-        if (repaymentTransfer.processed())
+        else
         {
-            throw sawtooth::InvalidTransaction("The transfer has been already processed");
+            // without the expiry index every Housekeeping scans the namespaces, the first one after the index
+            // has been switched on also indexes the entries that are left; switching it off abandons the index
+            auto const& namespaces = expiringNamespaces();
+            std::size_t first = 0;
+            std::string start;
+            // whether this sweep went through the FEE namespace from its first entry with the ledger on, only such
+            // a sweep has moved every Fee record into the ledger
+            bool feeFromStart = false;
+            if (bounded && !cursor.empty())
+            {
+                // a sweep that didn't fit in one transaction, it goes on at the height it was started for
+                std::vector<std::string> fields;
+                boost::split(fields, cursor, boost::is_any_of(" "));
+                if ((fields.size() != 3 && fields.size() != 4) || fields[1].size() != 1 || fields[1][0] < '0' ||
+                    fields[1][0] >= '0' + static_cast<int>(namespaces.size()))
+                {
+                    throw sawtooth::InvalidTransaction("Invalid housekeeping cursor");
+                }
+                sweepIdx = getBigint(fields[0]);
+                first = fields[1][0] - '0';
+                start = fields[2];
+                feeFromStart = fields.size() == 4 && fields[3] == "1";
+            }
+            for (std::size_t i = first; i < namespaces.size(); ++i)
+            {
+                auto const& expiring = namespaces[i];
+                if (migrated && expiring.decide == &Applicator::decideFee)
+                {
+                    continue;
+                }
+                if (expiring.decide == &Applicator::decideFee)
+                {
+                    feeFromStart = ledger && (start.empty() || feeFromStart);
+                }
+                // at most HOUSEKEEPING_BATCH_SIZE entries of every namespace per transaction when bounded, the
+                // height is processed only once the sweep has gone through all of them
+                std::size_t listed = 0;
+                std::string last;
+                bool more = false;
+                std::vector<Sweeping> batch;
+                auto sweep = [this, &batch, &sweepIdx, indexed, ledger]() {
+                    decideAll(sweepIdx, &batch);
+                    for (auto const& sweeping : batch)
+                    {
+                        boost::multiprecision::cpp_int expiresAt;
+                        StateAddress id;
+                        if (settle(sweeping, ledger, sweepIdx, &expiresAt) && indexed && parseAddress(sweeping.address, &id))
+                        {
+                            indexExpiry(id, expiresAt);
+                        }
+                    }
+                    batch.clear();
+                };
+                try
+                {
+                    // start is the last entry the previous transaction swept, the scan goes on right after it
+                    // whether or not it is still there
+                    for (auto const& entry : PrefixScan(ctx, namespacePrefix + expiring.prefix, start))
+                    {
+                        if (!start.empty() && entry.first <= start)
+                        {
+                            continue;
+                        }
+                        if (bounded && listed == HOUSEKEEPING_BATCH_SIZE)
+                        {
+                            more = true;
+                            break;
+                        }
+                        batch.push_back(Sweeping{ expiring.decide, entry.first, entry.second, Verdict() });
+                        last = entry.first;
+                        ++listed;
+                        if (batch.size() == HOUSEKEEPING_DECIDE_BATCH)
+                        {
+                            sweep();
+                        }
+                    }
+                    sweep();
+                }
+                catch (sawtooth::InvalidTransaction const&)
+                {
+                    throw;
+                }
+                catch (std::exception const& e)
+                {
+                    LOG4CXX_DEBUG(logger, "filter op failed");
+                    throw sawtooth::InvalidTransaction(e.what());
+                }
+                if (more)
+                {
+                    setState(state, cursorId, toString(sweepIdx) + " " + std::to_string(i) + " " + last + (feeFromStart ? " 1" : " 0"));
+                    return;
+                }
+                start.clear();
+            }
+            if (!cursor.empty())
+            {
+                deleteState(state, cursorId);
+            }
+            if (indexed)
+            {
+                setState(state, sweptBlockIdx, toString(sweepIdx));
+            }
+            else if (!stateData.empty())
+            {
+                deleteState(state, sweptBlockIdx);
+            }
+            if (ledger && !migrated && feeFromStart)
+            {
+                setState(state, ledgerVersionId, FEE_LEDGER_VERSION);
+            }
         }
-        repaymentTransfer.set_processed(true);
-
-        stateData = getStateData(dealOrder.loan_transfer(), true);
-        Transfer loanTransfer;
-        loanTransfer.ParseFromString(stateData);
-
-        boost::multiprecision::cpp_int head = lastBlockInt(ctx);
-        boost::multiprecision::cpp_int start = getBigint(loanTransfer.block());
-        boost::multiprecision::cpp_int maturity = getBigint(dealOrder.maturity());
 
-        boost::multiprecision::cpp_int ticks = ((head - start) + maturity) / maturity;
-        boost::multiprecision::cpp_int amount = calcInterest(getBigint(dealOrder.amount()), ticks, getBigint(dealOrder.interest()));
-        if (getBigint(repaymentTransfer.amount()) < amount)
+        if (sweepIdx > lastProcessedBlockIdx)
         {
-            throw sawtooth::InvalidTransaction("The transfer doesn't match the order");
+            reward(lastProcessedBlockIdx, sweepIdx);
+            setState(state, processedBlockIdx, toString(sweepIdx));
         }
+    }
+
+    typedef void (Applicator::*VerbHandler)(Params const&);
+
+    struct VerbEntry
+    {
+        char const* verb;
+        VerbHandler handler;
+    };
+
+    struct VerbTable
+    {
+        VerbEntry slots[VERB_SLOT_COUNT];
+    };
+
+    static constexpr VerbTable makeVerbTable()
+    {
+        // must follow the order of VERBS
+        VerbHandler const handlers[] = {
+            &Applicator::SendFunds,
+            &Applicator::RegisterAddress,
+            &Applicator::RegisterTransfer,
+            &Applicator::AddAskOrder,
+            &Applicator::AddBidOrder,
+            &Applicator::AddOffer,
+            &Applicator::AddDealOrder,
+            &Applicator::CompleteDealOrder,
+            &Applicator::LockDealOrder,
+            &Applicator::CloseDealOrder,
+            &Applicator::Exempt,
+            &Applicator::AddRepaymentOrder,
+            &Applicator::CompleteRepaymentOrder,
+            &Applicator::CloseRepaymentOrder,
+            &Applicator::CollectCoins,
+            &Applicator::Housekeeping
+        };
+        static_assert(sizeof(handlers) / sizeof(handlers[0]) == VERB_COUNT, "every verb needs a handler");
+
+        VerbTable table = {};
+        for (std::size_t i = 0; i < VERB_COUNT; ++i)
+        {
+            VerbEntry& entry = table.slots[verbSlot(VERBS[i], verbLength(VERBS[i]), VERB_SEED)];
+            entry.verb = VERBS[i];
+            entry.handler = handlers[i];
+        }
+        return table;
+    }
+
+    static const VerbTable VERB_TABLE;
+};
+
+constexpr Applicator::VerbTable Applicator::VERB_TABLE = Applicator::makeVerbTable();
+
+class Handler : public sawtooth::TransactionHandler
+{
+public:
+    Handler()
+    {
+    }
 
-        dealOrder.set_repayment_transfer(transferId);
+    std::string transaction_family_name() const
+    {
+        return NAMESPACE;
+    }
 
-        std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, dealOrderId, dealOrder);
-        addState(&states, transferId, repaymentTransfer);
-        addFee(mySighash, &states, walletId, wallet);
-        setState(state, states);
+    std::list<std::string> versions() const
+    {
+        return { "1.0", "1.1", "1.2", "1.3", "1.4", "1.5", "1.6", "1.7" };
     }
 
-    void Exempt(nlohmann::json const& query)
+    std::list<std::string> namespaces() const
     {
-        const std::string mySighash = getSighash();
-        Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
+        return { namespacePrefix };
+    }
 
-        const std::string dealOrderId = getStringLower(query, "p1", "dealOrderId");
-        const std::string transferId = getStringLower(query, "p2", "transferId");
+    sawtooth::TransactionApplicatorUPtr GetApplicator(sawtooth::TransactionUPtr txn, sawtooth::GlobalStateUPtr state)
+    {
+        return sawtooth::TransactionApplicatorUPtr(new Applicator(std::move(txn), std::move(state)));
+    }
+};
 
-        std::string stateData = getStateData(dealOrderId, true);
-        DealOrder dealOrder;
-        dealOrder.ParseFromString(stateData);
-        if (!dealOrder.repayment_transfer().empty())
-        {
-            throw sawtooth::InvalidTransaction("The deal has been already closed");
-        }
+static void writeAt(std::ostream& out, std::uint64_t offset, void const* data, std::size_t size)
+{
+    out.seekp(offset);
+    out.write(static_cast<char const*>(data), size);
+}
 
-        stateData = getStateData(transferId, true);
-        Transfer transfer;
-        transfer.ParseFromString(stateData);
+static std::string readAt(std::istream& in, TransitionData::Span const& span)
+{
+    std::string ret(static_cast<std::size_t>(span.size), '\0');
+    in.seekg(span.offset);
+    in.read(&ret[0], ret.size());
+    return ret;
+}
 
-        if (transfer.order() != dealOrderId)
-        {
-            throw sawtooth::InvalidTransaction("The transfer doesn't match the order");
-        }
-        if (transfer.processed())
+// the slots of the guid index, a guid that comes again takes the place of the earlier one like it did in the
+// map the index replaces; the guids are read back from the output only when two of them hash the same
+static std::vector<TransitionData::GuidSlot> buildGuidIndex(std::vector<TransitionData::BlockRecord> const& blockTable,
+    std::vector<TransitionData::TxRecord> const& txTable, std::vector<std::uint64_t> const& hashes, std::fstream& out)
+{
+    std::uint64_t slots = 1;
+    while (slots < 2 * txTable.size() + 1)
+        slots <<= 1;
+    TransitionData::GuidSlot empty = { 0, TransitionData::EMPTY_SLOT, 0 };
+    std::vector<TransitionData::GuidSlot> index(static_cast<std::size_t>(slots), empty);
+    out.flush();
+    for (std::size_t blockIdx = 0; blockIdx < blockTable.size(); ++blockIdx)
+    {
+        auto const& block = blockTable[blockIdx];
+        for (std::uint64_t txIdx = 0; txIdx < block.txCount; ++txIdx)
         {
-            throw sawtooth::InvalidTransaction("The transfer has been already processed");
+            std::uint64_t tx = block.firstTx + txIdx;
+            std::uint64_t slot = hashes[tx] & (slots - 1);
+            for (; index[slot].block != TransitionData::EMPTY_SLOT; slot = (slot + 1) & (slots - 1))
+            {
+                auto const& taken = index[slot];
+                if (taken.hash == hashes[tx] &&
+                    readAt(out, txTable[blockTable[taken.block].firstTx + taken.txIdx].guid) == readAt(out, txTable[tx].guid))
+                {
+                    break;
+                }
+            }
+            index[slot].hash = hashes[tx];
+            index[slot].block = static_cast<std::uint32_t>(blockIdx);
+            index[slot].txIdx = static_cast<std::uint32_t>(txIdx);
         }
-        transfer.set_processed(true);
+    }
+    return index;
+}
 
-        stateData = getStateData(dealOrder.src_address(), true);
-        Address address;
-        address.ParseFromString(stateData);
+// turns the text transition file (height, signer, then guid, sighash and base64 payload per transaction up to
+// a "." line, block after block) into the mapped format, the bytes go out as they are read and only the tables
+// are held in memory
+static bool convertTransitionFile(char const* from, char const* to)
+{
+    std::ifstream text(from);
+    if (!text.good())
+    {
+        std::cerr << "Can't read " << from << std::endl;
+        return false;
+    }
+    // written aside and renamed over to once complete, a failed conversion leaves nothing to be mapped
+    std::string temporary = std::string(to) + ".tmp";
+    std::fstream out(temporary, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    std::vector<TransitionData::BlockRecord> blockTable;
+    std::vector<TransitionData::TxRecord> txTable;
+    std::vector<std::uint64_t> hashes;
+    std::uint64_t offset = sizeof(TransitionData::Header);
+    auto append = [&out, &offset](char const* data, std::size_t size) {
+        TransitionData::Span span = { offset, size };
+        out.write(data, size);
+        offset += size;
+        return span;
+    };
 
-        if (mySighash != address.sighash())
+    try
+    {
+        out.seekp(offset);
+        for (;;)
         {
-            throw sawtooth::InvalidTransaction("Only an investor can exempt a deal");
+            std::string line;
+            std::getline(text, line);
+            if (line.length() == 0)
+                break;
+            std::size_t blockIdx = getBigint(line).convert_to<std::size_t>();
+            if (blockTable.size() <= blockIdx)
+            {
+                blockTable.resize(blockIdx + 1, TransitionData::BlockRecord());
+            }
+            std::getline(text, line);
+            TransitionData::BlockRecord& block = blockTable[blockIdx];
+            block.signer = append(line.data(), line.size());
+            block.firstTx = txTable.size();
+            block.txCount = 0;
+            for (;;)
+            {
+                std::getline(text, line);
+                if (line == "." || !text)
+                    break;
+                TransitionData::TxRecord tx;
+                tx.guid = append(line.data(), line.size());
+                hashes.push_back(TransitionData::guidHash(line));
+                std::getline(text, line);
+                tx.sighash = append(line.data(), line.size());
+                std::getline(text, line);
+                std::vector<std::uint8_t> payload = decodeBase64(line);
+                tx.payload = append(reinterpret_cast<char const*>(payload.data()), payload.size());
+                txTable.push_back(tx);
+                ++block.txCount;
+            }
         }
-
-        dealOrder.set_repayment_transfer(transferId);
-
-        std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, dealOrderId, dealOrder);
-        addState(&states, transferId, transfer);
-        addFee(mySighash, &states, walletId, wallet);
-        setState(state, states);
     }
-
-    void AddRepaymentOrder(nlohmann::json const& query)
+    catch (std::exception const& e)
     {
-        const std::string mySighash = getSighash();
-        Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
-
-        const std::string dealOrderId = getStringLower(query, "p1", "dealOrderId");
-        const std::string addressId = getStringLower(query, "p2", "addressId");
-        const std::string amount = getBigint(query, "p3", "amount");
-        const ::google::protobuf::uint64 expiration = getUint64(query, "p4", "expiration");
+        std::cerr << "Can't convert " << from << ": " << e.what() << std::endl;
+        out.close();
+        std::remove(temporary.c_str());
+        return false;
+    }
 
-        std::string const& guid = getGuid();
+    TransitionData::Header header = {};
+    std::memcpy(header.magic, TransitionData::MAGIC, sizeof(header.magic));
+    header.blockCount = blockTable.size();
+    header.txCount = txTable.size();
+    header.blockTable = (offset + alignof(TransitionData::BlockRecord) - 1) / alignof(TransitionData::BlockRecord) * alignof(TransitionData::BlockRecord);
+    header.txTable = header.blockTable + blockTable.size() * sizeof(TransitionData::BlockRecord);
+    header.guidIndex = header.txTable + txTable.size() * sizeof(TransitionData::TxRecord);
+    std::vector<TransitionData::GuidSlot> guidIndex = buildGuidIndex(blockTable, txTable, hashes, out);
+    header.guidSlots = guidIndex.size();
+    if (!blockTable.empty())
+        writeAt(out, header.blockTable, blockTable.data(), blockTable.size() * sizeof(TransitionData::BlockRecord));
+    if (!txTable.empty())
+        writeAt(out, header.txTable, txTable.data(), txTable.size() * sizeof(TransitionData::TxRecord));
+    writeAt(out, header.guidIndex, guidIndex.data(), guidIndex.size() * sizeof(TransitionData::GuidSlot));
+    writeAt(out, 0, &header, sizeof(header));
+    out.close();
+    if (!out)
+    {
+        std::cerr << "Can't write " << temporary << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+#if !IS_LINUX
+    std::remove(to);
+#endif
+    if (std::rename(temporary.c_str(), to) != 0)
+    {
+        std::cerr << "Can't replace " << to << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    std::cout << "Converted " << header.blockCount << " blocks and " << header.txCount << " transactions to " << to << std::endl;
+    return true;
+}
 
-        const std::string id = makeAddress(REPAYMENT_ORDER, guid);
-        std::string stateData = getStateData(id);
-        if (!stateData.empty())
+// replays all of the transition data the way mode says and returns the state it ends with
+static PersistentState replayTransition(Applicator::ReplayMode mode)
+{
+    transitioningState = PersistentState();
+    tipCurrentState.clear();
+    // nothing a replayed verb reads comes from the transaction itself, a replica only needs one to copy
+    sawtooth::TransactionUPtr txn(new sawtooth::Transaction(sawtooth::TransactionHeaderPtr(), std::make_shared<std::string>(),
+        std::make_shared<std::string>(), std::make_shared<std::string>()));
+    Applicator applicator(std::move(txn), sawtooth::GlobalStateUPtr());
+    applicator.replayMode = mode;
+    for (std::size_t i = 1; i < blocks.size(); ++i)
+    {
+        for (std::size_t j = 0; j < blocks.txCount(i); ++j)
         {
-            throw sawtooth::InvalidTransaction("Duplicated id");
+            applicator.replay(blocks.tx(i, j), static_cast<int>(i) - 1);
         }
+        applicator.replayBlockEnd(static_cast<int>(i));
+    }
+    applicator.flushReplay();
+    return transitioningState;
+}
 
-        stateData = getStateData(dealOrderId);
-        DealOrder dealOrder;
-        dealOrder.ParseFromString(stateData);
-        if (dealOrder.sighash() == mySighash)
+// a check of the speculative replay: the transition data is replayed with the real verbs once in turn and once
+// ahead of turn, and the states they end with have to be the same
+static bool verifyReplay()
+{
+    try
+    {
+        if (!blocks.open(transitionDataFile))
         {
-            throw sawtooth::InvalidTransaction("Fundraisers cannot create repayment orders");
+            std::cerr << "Can't read " << transitionDataFile << std::endl;
+            return false;
         }
-        if (dealOrder.loan_transfer().empty() || !dealOrder.repayment_transfer().empty())
+        transitioning = true;
+        stopCheckpointing();
+
+        PersistentState serial = replayTransition(Applicator::ReplayMode::Serial);
+        PersistentState speculative = replayTransition(Applicator::ReplayMode::Speculative);
+        std::size_t compared = 0;
+        PersistentState::Cursor i(serial, "");
+        PersistentState::Cursor j(speculative, "");
+        for (; i.valid() && j.valid(); i.next(), j.next(), ++compared)
         {
-            throw sawtooth::InvalidTransaction("A repayment order can be created only for a deal with an active loan");
+            if (i.key() != j.key() || i.value() != j.value())
+                break;
         }
-
-        stateData = getStateData(dealOrder.src_address());
-        Address srcAddress;
-        srcAddress.ParseFromString(stateData);
-        if (srcAddress.sighash() == mySighash)
+        if (i.valid() || j.valid())
         {
-            throw sawtooth::InvalidTransaction("Investors cannot create repayment orders");
+            std::cerr << "Replays differ at " << (i.valid() && (!j.valid() || i.key() <= j.key()) ? i.key() : j.key()) << " after "
+                << compared << " identical entries" << std::endl;
+            return false;
         }
+        std::cout << "Serial and speculative replays of " << blocks.size() << " blocks agree on " << compared << " entries" << std::endl;
+        return true;
+    }
+    catch (std::exception const& e)
+    {
+        std::cerr << "Can't replay " << transitionDataFile << ": " << e.what() << std::endl;
+        return false;
+    }
+}
 
-        stateData = getStateData(addressId);
-        Address newAddress;
-        newAddress.ParseFromString(stateData);
+// calcInterest as it was first written, a cpp_int step per tick, to check the faster one against
+static boost::multiprecision::cpp_int calcInterestByTicks(boost::multiprecision::cpp_int const& amount, boost::multiprecision::cpp_int const& ticks, boost::multiprecision::cpp_int const& interest)
+{
+    boost::multiprecision::cpp_int total = amount;
+    for (boost::multiprecision::cpp_int i = 0; i < ticks; ++i)
+    {
+        boost::multiprecision::cpp_int compound = (total * interest) / INTEREST_MULTIPLIER;
+        total += compound;
+    }
+    return total;
+}
 
-        if (srcAddress.blockchain() != newAddress.blockchain() || srcAddress.network() != newAddress.network() || srcAddress.value() == newAddress.value())
+static boost::multiprecision::cpp_int randomBigint(std::mt19937_64& random, unsigned bits)
+{
+    boost::multiprecision::cpp_int ret = 0;
+    for (unsigned i = 0; i < bits; i += 64)
+    {
+        ret = (ret << 64) | random();
+    }
+    return ret >> ((64 - bits % 64) % 64);
+}
+
+// a check of calcInterest against calcInterestByTicks on the amounts, rates and terms around the edges of its
+// shortcuts and where it leaves 512 bit arithmetic, then on random ones of up to 300 bits; false on the first
+// difference
+static bool verifyInterest()
+{
+    const boost::multiprecision::cpp_int limit(INTEREST_FAST_LIMIT);
+    const boost::multiprecision::cpp_int amounts[] = { 0, 1, 2, INTEREST_MULTIPLIER - 1, INTEREST_MULTIPLIER,
+        INTEREST_MULTIPLIER + 1, limit / 3, limit - limit / 100, limit - INTEREST_MULTIPLIER, limit - 1, limit, limit + 1, limit * 3 };
+    const boost::multiprecision::cpp_int interests[] = { 0, 1, 2, 1000, INTEREST_MULTIPLIER / 10, INTEREST_MULTIPLIER - 1,
+        INTEREST_MULTIPLIER, INTEREST_MULTIPLIER + 1, limit - 1, limit, limit + 1 };
+    const boost::multiprecision::cpp_int terms[] = { -1, 0, 1, 2, 3, 10, 100, 1000 };
+
+    std::size_t checked = 0;
+    auto check = [&checked](boost::multiprecision::cpp_int const& amount, boost::multiprecision::cpp_int const& ticks, boost::multiprecision::cpp_int const& interest) {
+        ++checked;
+        if (calcInterest(amount, ticks, interest) == calcInterestByTicks(amount, ticks, interest))
+            return true;
+        std::cerr << "calcInterest differs on amount " << amount << ", " << ticks << " ticks, interest " << interest << std::endl;
+        return false;
+    };
+    for (auto const& amount : amounts)
+    {
+        for (auto const& interest : interests)
         {
-            throw sawtooth::InvalidTransaction("Invalid address");
+            for (auto const& ticks : terms)
+            {
+                if (!check(amount, ticks, interest))
+                    return false;
+            }
         }
+    }
 
-        RepaymentOrder repaymentOrder;
-        repaymentOrder.set_blockchain(srcAddress.blockchain());
-        repaymentOrder.set_src_address(addressId);
-        repaymentOrder.set_dst_address(dealOrder.src_address());
-        repaymentOrder.set_amount(amount);
-        repaymentOrder.set_expiration(expiration);
-        repaymentOrder.set_block(lastBlock(ctx));
-        repaymentOrder.set_deal(dealOrderId);
-        repaymentOrder.set_sighash(mySighash);
+    std::mt19937_64 random(1);
+    for (int i = 0; i < 20000; ++i)
+    {
+        boost::multiprecision::cpp_int amount = randomBigint(random, random() % 301);
+        // mostly the rates deal orders have, now and then one that doesn't fit 256 bits either and grows the
+        // total too fast for long terms
+        bool huge = random() % 8 == 0;
+        boost::multiprecision::cpp_int interest = randomBigint(random, huge ? random() % 301 : random() % 41);
+        boost::multiprecision::cpp_int ticks = random() % (huge ? 21 : 1001);
+        if (!check(amount, ticks, interest))
+            return false;
+    }
+    std::cout << "calcInterest agrees with the loop over every tick on " << checked << " cases" << std::endl;
+    return true;
+}
 
-        std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, id, repaymentOrder);
-        addFee(mySighash, &states, walletId, wallet);
-        setState(state, states);
+// the text of a call, or the InvalidTransaction it throws
+template <typename F>
+static std::string outcomeOf(F f)
+{
+    try
+    {
+        return f();
+    }
+    catch (sawtooth::InvalidTransaction const& e)
+    {
+        return std::string("throws ") + e.what();
     }
+}
 
-    void CompleteRepaymentOrder(nlohmann::json const& query)
+// a decimal of up to 80 digits, now and then with a leading zero, a sign or a hex prefix in front
+static std::string randomAmountString(std::mt19937_64& random)
+{
+    std::string ret;
+    for (std::size_t i = 0, digits = random() % 81; i < digits; ++i)
     {
-        const std::string mySighash = getSighash();
-        Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
+        ret += static_cast<char>('0' + random() % 10);
+    }
+    switch (random() % 16)
+    {
+    case 0:
+        return "0" + ret;
+    case 1:
+        return "-" + ret;
+    case 2:
+        return "0x" + ret;
+    default:
+        return ret;
+    }
+}
 
-        const std::string repaymentOrderId = getStringLower(query, "p1", "repaymentOrderId");
+// the head of a CBOR item, now and then with a wider length than it needs as from_cbor takes those too
+static void appendCborHead(std::string* out, std::uint8_t major, std::uint64_t value, std::mt19937_64& random)
+{
+    int bytes = value < 24 ? 0 : value <= 0xff ? 1 : value <= 0xffff ? 2 : value <= 0xffffffff ? 4 : 8;
+    if (bytes < 8 && random() % 8 == 0)
+        bytes = bytes == 0 ? 1 : 2 * bytes;
+    std::uint8_t info = bytes == 0 ? static_cast<std::uint8_t>(value) : bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27;
+    out->push_back(static_cast<char>(major << 5 | info));
+    for (int i = bytes - 1; i >= 0; --i)
+        out->push_back(static_cast<char>(value >> (8 * i)));
+}
 
-        std::string stateData = getStateData(repaymentOrderId, true);
-        RepaymentOrder repaymentOrder;
-        repaymentOrder.ParseFromString(stateData);
+// text with quotes, backslashes, control characters and bytes above 0x7f among the plain ones, definite or in chunks
+static void appendCborText(std::string* out, std::string const& text, std::mt19937_64& random)
+{
+    if (random() % 5 != 0)
+    {
+        appendCborHead(out, 3, text.size(), random);
+        out->append(text);
+        return;
+    }
+    out->push_back(static_cast<char>(0x7f));
+    for (std::size_t pos = 0; pos < text.size();)
+    {
+        std::size_t chunk = std::min<std::size_t>(text.size() - pos, random() % 8);
+        appendCborHead(out, 3, chunk, random);
+        out->append(text, pos, chunk);
+        pos += chunk;
+    }
+    out->push_back(static_cast<char>(0xff));
+}
 
-        stateData = getStateData(repaymentOrder.dst_address(), true);
-        Address address;
-        address.ParseFromString(stateData);
-        if (address.sighash() != mySighash)
+static std::string randomText(std::mt19937_64& random)
+{
+    static const char special[] = "\"\\\b\f\n\r\t\x01\x1f\x7f";
+    std::string ret;
+    for (std::size_t i = 0, size = random() % 40; i < size; ++i)
+    {
+        switch (random() % 10)
         {
-            throw sawtooth::InvalidTransaction("Only an investor can complete a repayment order");
+        case 0:
+            ret.push_back(special[random() % (sizeof(special) - 1)]);
+            break;
+        case 1:
+            ret.push_back(static_cast<char>(0x80 + random() % 0x80));
+            break;
+        default:
+            ret.push_back(static_cast<char>(' ' + random() % 95));
         }
+    }
+    return ret;
+}
 
-        stateData = getStateData(repaymentOrder.deal(), true);
-        DealOrder dealOrder;
-        dealOrder.ParseFromString(stateData);
-        if (!dealOrder.lock().empty())
+// any item, mostly the kinds the payload reader can skip over
+static void appendCborItem(std::string* out, std::mt19937_64& random, int depth)
+{
+    std::uint64_t kind = random() % 20;
+    if (depth >= 3 && kind >= 16)
+        kind = 0;
+    if (kind < 8)
+    {
+        appendCborText(out, randomText(random), random);
+    }
+    else if (kind < 10)
+    {
+        std::uint8_t major = random() % 2;
+        int shift = random() % 64;
+        appendCborHead(out, major, random() >> shift, random);
+    }
+    else if (kind < 12)
+    {
+        static const std::uint8_t simple[] = { 0xf4, 0xf5, 0xf6, 0xf7 };
+        out->push_back(static_cast<char>(simple[random() % sizeof(simple)]));
+    }
+    else if (kind < 14)
+    {
+        static const int widths[] = { 2, 4, 8 };
+        int width = widths[random() % 3];
+        out->push_back(static_cast<char>(width == 2 ? 0xf9 : width == 4 ? 0xfa : 0xfb));
+        for (int i = 0; i < width; ++i)
+            out->push_back(static_cast<char>(random()));
+    }
+    else if (kind == 14)
+    {
+        // byte strings and tags, which the reader leaves to from_cbor
+        std::size_t size = random() % 4;
+        if (random() % 2 == 0)
         {
-            throw sawtooth::InvalidTransaction("The deal has been already locked");
+            appendCborHead(out, 2, size, random);
+            out->append(size, 'b');
         }
-
-        repaymentOrder.set_previous_owner(mySighash);
-        dealOrder.set_lock(mySighash);
-
-        std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, repaymentOrderId, repaymentOrder);
-        addState(&states, repaymentOrder.deal(), dealOrder);
-        addFee(mySighash, &states, walletId, wallet);
-        setState(state, states);
+        else
+        {
+            appendCborHead(out, 6, size, random);
+            appendCborItem(out, random, depth + 1);
+        }
+    }
+    else if (kind == 15)
+    {
+        out->push_back(static_cast<char>(random()));
+    }
+    else if (kind < 18)
+    {
+        std::size_t count = random() % 4;
+        bool indefinite = random() % 4 == 0;
+        if (indefinite)
+            out->push_back(static_cast<char>(0x9f));
+        else
+            appendCborHead(out, 4, count, random);
+        for (std::size_t i = 0; i < count; ++i)
+            appendCborItem(out, random, depth + 1);
+        if (indefinite)
+            out->push_back(static_cast<char>(0xff));
+    }
+    else
+    {
+        std::size_t count = random() % 4;
+        bool indefinite = random() % 4 == 0;
+        if (indefinite)
+            out->push_back(static_cast<char>(0xbf));
+        else
+            appendCborHead(out, 5, count, random);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            appendCborText(out, randomText(random), random);
+            appendCborItem(out, random, depth + 1);
+        }
+        if (indefinite)
+            out->push_back(static_cast<char>(0xff));
     }
+}
 
-    void CloseRepaymentOrder(nlohmann::json const& query)
+// a transaction payload: a map holding the verb, some of p1..p6 and other keys, definite or indefinite, every now
+// and then cut short, with a byte changed or with bytes after it
+static std::string randomPayload(std::mt19937_64& random)
+{
+    static char const* const keys[] = { "v", "p1", "p2", "p3", "p4", "p5", "p6", "p7", "p", "V", "" };
+    std::string ret;
+    std::size_t count = 1 + random() % 8;
+    // most payloads have a verb, without one the reader gives up like from_cbor does
+    std::size_t verbAt = random() % 8 == 0 ? count : random() % count;
+    bool indefinite = random() % 4 == 0;
+    if (indefinite)
+        ret.push_back(static_cast<char>(0xbf));
+    else
+        appendCborHead(&ret, 5, count, random);
+    for (std::size_t i = 0; i < count; ++i)
     {
-        const std::string mySighash = getSighash();
-        Wallet wallet;
-        std::string walletId = charge(mySighash, &wallet);
-
-        const std::string repaymentOrderId = getStringLower(query, "p1", "repaymentOrderId");
-        const std::string transferId = getStringLower(query, "p2", "transferId");
-
-        std::string stateData = getStateData(repaymentOrderId, true);
-        RepaymentOrder repaymentOrder;
-        repaymentOrder.ParseFromString(stateData);
-        if (repaymentOrder.sighash() != mySighash)
+        std::size_t key = i == verbAt ? 0 : random() % 20;
+        if (key >= sizeof(keys) / sizeof(keys[0]) && key % 4 == 0)
         {
-            throw sawtooth::InvalidTransaction("Only a collector can close a repayment order");
+            appendCborItem(&ret, random, 1);
+            appendCborItem(&ret, random, 1);
+            continue;
         }
+        key %= sizeof(keys) / sizeof(keys[0]);
+        appendCborText(&ret, keys[key], random);
+        if (key < 1 + PARAM_COUNT)
+            appendCborText(&ret, randomText(random), random);
+        else
+            appendCborItem(&ret, random, 1);
+    }
+    if (indefinite)
+        ret.push_back(static_cast<char>(0xff));
 
-        stateData = getStateData(transferId, true);
-        Transfer transfer;
-        transfer.ParseFromString(stateData);
+    switch (random() % 12)
+    {
+    case 0:
+        ret.resize(random() % (ret.size() + 1));
+        break;
+    case 1:
+        if (!ret.empty())
+            ret[random() % ret.size()] = static_cast<char>(random());
+        break;
+    case 2:
+        appendCborItem(&ret, random, 1);
+        break;
+    default:
+        break;
+    }
+    return ret;
+}
 
-        if (transfer.order() != repaymentOrderId || transfer.amount() != repaymentOrder.amount())
-        {
-            throw sawtooth::InvalidTransaction("The transfer doesn't match the order");
-        }
-        if (transfer.sighash() != mySighash)
+// what decoding a payload ends with: the verb and the parameters with their lengths, or the error
+static std::string payloadOutcome(void (*decode)(std::uint8_t const*, std::size_t, std::string*, Params*), std::string const& payload)
+{
+    std::string cmd;
+    Params params;
+    try
+    {
+        decode(reinterpret_cast<std::uint8_t const*>(payload.data()), payload.size(), &cmd, &params);
+    }
+    catch (sawtooth::InvalidTransaction const& e)
+    {
+        return std::string("InvalidTransaction ") + e.what();
+    }
+    catch (std::exception const& e)
+    {
+        return std::string("exception ") + e.what();
+    }
+    std::ostringstream ret;
+    ret << cmd.size() << ':' << cmd;
+    for (int i = 0; i < PARAM_COUNT; ++i)
+    {
+        if (params.present[i])
+            ret << ' ' << params.values[i].size() << ':' << params.values[i];
+        else
+            ret << " -";
+    }
+    return ret.str();
+}
+
+// a check of the payload reader against decoding the payload with nlohmann::json the way it was done before, on
+// random payloads; false on the first one they decode differently. Payloads with a verb or parameter that isn't
+// text are left out, the old path renders those through trimQuotes, which asserts on them in debug builds
+static bool verifyPayloads()
+{
+    std::mt19937_64 random(1);
+    std::size_t checked = 0;
+    for (int i = 0; i < 200000; ++i)
+    {
+        std::string payload = randomPayload(random);
+        try
         {
-            throw sawtooth::InvalidTransaction("The transfer doesn't match the signer");
+            nlohmann::json query = nlohmann::json::from_cbor(std::vector<std::uint8_t>(payload.begin(), payload.end()));
+            bool text = true;
+            if (query.is_object())
+            {
+                for (auto const& key : { "v", "p1", "p2", "p3", "p4", "p5", "p6" })
+                {
+                    auto found = query.find(key);
+                    text = text && (found == query.end() || found->is_string());
+                }
+            }
+            if (!text)
+                continue;
         }
-        if (transfer.processed())
+        catch (std::exception const&)
         {
-            throw sawtooth::InvalidTransaction("The transfer has been already processed");
         }
-        transfer.set_processed(true);
 
-        stateData = getStateData(repaymentOrder.deal(), true);
-        DealOrder dealOrder;
-        dealOrder.ParseFromString(stateData);
-        stateData = getStateData(dealOrder.src_address(), true);
-        Address srcAddress;
-        srcAddress.ParseFromString(stateData);
-        if (dealOrder.lock() != srcAddress.sighash())
+        ++checked;
+        std::string expected = payloadOutcome(&Applicator::domToParams, payload);
+        std::string actual = payloadOutcome(&Applicator::cborToParams, payload);
+        if (actual != expected)
         {
-            throw sawtooth::InvalidTransaction("The deal must be locked");
+            std::ostringstream hex;
+            for (char c : payload)
+                hex << std::hex << std::setw(2) << std::setfill('0') << (static_cast<unsigned>(c) & 0xff);
+            std::cerr << "Payload " << hex.str() << " decodes to " << actual << " instead of " << expected << std::endl;
+            return false;
         }
+    }
+    std::cout << "The payload reader agrees with nlohmann::json on " << checked << " payloads" << std::endl;
+    return true;
+}
 
-        dealOrder.set_src_address(repaymentOrder.src_address());
-        dealOrder.set_lock("");
-        repaymentOrder.set_transfer(transferId);
+// a check of Amount against the cpp_int arithmetic it stands in for: parsing, formatting, the sums of addAmounts
+// and the comparisons and differences charge and SendFunds make, on the strings around the edges of the fast path
+// and on random ones; false on the first difference
+static bool verifyAmounts()
+{
+    std::vector<std::string> samples = { "", "0", "00", "01", "1", "-1", "-0", "0x10", "010", "1.5", " 1", "1 ", "abc",
+        std::string(AMOUNT_MAX_DIGITS, '9'), std::string(AMOUNT_MAX_DIGITS + 1, '9'), "1" + std::string(AMOUNT_MAX_DIGITS - 1, '0'),
+        "1" + std::string(AMOUNT_MAX_DIGITS, '0'), toString(boost::multiprecision::cpp_int(std::numeric_limits<Amount>::max())),
+        TX_FEE_STRING, REWARD_AMOUNT_STRING };
+    std::size_t edges = samples.size();
+    std::mt19937_64 random(1);
+    for (int i = 0; i < 2000; ++i)
+    {
+        samples.push_back(randomAmountString(random));
+    }
 
-        std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, repaymentOrderId, repaymentOrder);
-        addState(&states, repaymentOrder.deal(), dealOrder);
-        addState(&states, transferId, transfer);
-        addFee(mySighash, &states, walletId, wallet);
-        setState(state, states);
+    std::size_t checked = 0;
+    for (std::size_t i = 0; i < samples.size(); ++i)
+    {
+        // the edge strings go with every other string, the random ones with a few random partners
+        for (std::size_t k = 0; k < (i < edges ? samples.size() : 100); ++k)
+        {
+            std::string const& a = samples[i];
+            std::string const& b = samples[i < edges ? k : random() % samples.size()];
+            ++checked;
+
+            bool plain = !a.empty() && a.size() <= AMOUNT_MAX_DIGITS && (a[0] != '0' || a.size() == 1) &&
+                a.find_first_not_of("0123456789") == std::string::npos;
+            Amount x;
+            bool parsed = toAmount(a, &x);
+            bool same = parsed == plain && (!parsed || toString(x) == toString(getBigint(a)));
+
+            std::string sum = outcomeOf([&] {
+                boost::multiprecision::cpp_int ret = getBigint(a);
+                ret += getBigint(b);
+                return toString(ret);
+            });
+            same = same && outcomeOf([&] { return addAmounts(a, b); }) == sum;
+            // the caller of the three argument form has parsed the delta already
+            boost::multiprecision::cpp_int delta;
+            if (outcomeOf([&] { delta = getBigint(b); return std::string(); }).empty())
+                same = same && outcomeOf([&] { return addAmounts(a, b, delta); }) == sum;
+
+            Amount y;
+            if (parsed && toAmount(b, &y))
+            {
+                boost::multiprecision::cpp_int cx = getBigint(a);
+                boost::multiprecision::cpp_int cy = getBigint(b);
+                same = same && (x < y) == (cx < cy) && (x < y || toString(Amount(x - y)) == toString(cx - cy));
+            }
+            if (!same)
+            {
+                std::cerr << "Amount differs from cpp_int on \"" << a << "\" and \"" << b << "\"" << std::endl;
+                return false;
+            }
+        }
     }
+    std::cout << "Amount agrees with cpp_int on " << checked << " pairs" << std::endl;
+    return true;
+}
 
-    void CollectCoins(nlohmann::json const& query)
+// a verb's parameters the way the verbs read them before the schemas: copied out, lowercased with boost and
+// converted from the copy, one line per parameter
+template<std::size_t N>
+static std::string paramsByCopy(Params const& query, ParamSpec const (&specs)[N])
+{
+    std::string ret;
+    for (ParamSpec const& spec : specs)
     {
-        const std::string ethAddress = getStringLower(query, "p1", "ethAddress");
-        boost::multiprecision::cpp_int amount;
-        const std::string amountString = getBigint(query, "p2", "amount", &amount);
-        const std::string blockchainTxId = getStringLower(query, "p3", "blockchainTxId");
+        boost::string_ref param = getParam(query, spec.index, spec.name);
+        std::string text(param.data(), param.size());
+        switch (spec.type)
+        {
+        case ParamType::Id:
+        case ParamType::LowerString:
+            boost::to_lower(text);
+            break;
+        case ParamType::String:
+            break;
+        case ParamType::Bigint:
+            text += " " + toString(getBigint(text));
+            break;
+        case ParamType::SignedBigint:
+            text += " " + toString(getBigint(text, true));
+            break;
+        case ParamType::Uint64:
+            text = std::to_string(parseUint64(text));
+            break;
+        }
+        ret += text + "\n";
+    }
+    return ret;
+}
 
-        const std::string id = makeAddress(ERC20, blockchainTxId);
-        std::string stateData = getStateData(id);
-        if (!stateData.empty())
+// the same through decodeParams
+template<std::size_t N>
+static std::string paramsBySchema(Params const& query, ParamSpec const (&specs)[N])
+{
+    Args<N> args;
+    decodeParams(query, specs, &args);
+    std::string ret;
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        std::string text = args[i].str();
+        switch (specs[i].type)
         {
-            throw sawtooth::InvalidTransaction("Already collected");
+        case ParamType::Bigint:
+        case ParamType::SignedBigint:
+            text += " " + toString(args[i].bigint);
+            break;
+        case ParamType::Uint64:
+            text = std::to_string(args[i].number);
+            break;
+        default:
+            break;
         }
+        ret += text + "\n";
+    }
+    return ret;
+}
 
-        const std::string mySighash = getSighash();
+// a parameter of any kind: an amount, a number around the ends of the 19 digit chunks and of uint64, or text
+// with upper case letters, punctuation and high bytes
+static std::string randomParam(std::mt19937_64& random)
+{
+    static char const* const edges[] = { "18446744073709551615", "18446744073709551616", "9999999999999999999",
+        "10000000000000000000", "1000000000000000000", "+1", " 1", "1 ", "-0", "0" };
+    std::string ret;
+    switch (random() % 4)
+    {
+    case 0:
+        return randomAmountString(random);
+    case 1:
+        return edges[random() % (sizeof(edges) / sizeof(edges[0]))];
+    case 2:
+        ret += static_cast<char>('1' + random() % 9);
+        for (std::size_t i = 1, digits = 17 + random() % 23; i < digits; ++i)
+        {
+            ret += static_cast<char>('0' + random() % 10);
+        }
+        return ret;
+    default:
+        for (std::size_t i = 0, size = random() % 21; i < size; ++i)
+        {
+            static char const text[] = "0123456789abcdefxyzABCDEFXYZ-+ .\"\\";
+            ret += random() % 16 == 0 ? static_cast<char>(0x80 + random() % 0x80) : text[random() % (sizeof(text) - 1)];
+        }
+        return ret;
+    }
+}
 
-        std::stringstream gatewayCommand;
-        gatewayCommand << "ethereum verify " << ethAddress << " creditcoin " << mySighash << " " << amountString << " " << blockchainTxId << " unused";
-        verify(gatewayCommand);
+template<std::size_t N>
+static bool checkParams(Params const& query, ParamSpec const (&specs)[N], char const* verb)
+{
+    std::string expected = outcomeOf([&] { return paramsByCopy(query, specs); });
+    std::string actual = outcomeOf([&] { return paramsBySchema(query, specs); });
+    if (actual != expected)
+    {
+        std::cerr << verb << " decodes its parameters to\n" << actual << "instead of\n" << expected << std::endl;
+        return false;
+    }
+    return true;
+}
 
-        const std::string walletId = namespacePrefix + WALLET + mySighash;
-        stateData = getStateData(walletId);
+// a check of the parameter schemas: random parameters, some of them missing, are read by every verb's schema
+// through decodeParams and the way the verbs read them before, and have to come out the same or fail the same
+// way; false on the first difference
+static bool verifyParams()
+{
+    std::mt19937_64 random(1);
+    int checked = 0;
+    for (; checked < 20000; ++checked)
+    {
+        Params query;
+        for (int i = 0; i < PARAM_COUNT; ++i)
+        {
+            query.present[i] = random() % 8 != 0;
+            query.storage[i] = randomParam(random);
+            query.values[i] = query.storage[i];
+        }
+        bool same = checkParams(query, SEND_FUNDS_PARAMS, "SendFunds") &&
+            checkParams(query, REGISTER_ADDRESS_PARAMS, "RegisterAddress") &&
+            checkParams(query, REGISTER_TRANSFER_PARAMS, "RegisterTransfer") &&
+            checkParams(query, ORDER_PARAMS, "AddAskOrder") &&
+            checkParams(query, ADD_OFFER_PARAMS, "AddOffer") &&
+            checkParams(query, ADD_DEAL_ORDER_PARAMS, "AddDealOrder") &&
+            checkParams(query, DEAL_ORDER_TRANSFER_PARAMS, "CompleteDealOrder") &&
+            checkParams(query, LOCK_DEAL_ORDER_PARAMS, "LockDealOrder") &&
+            checkParams(query, ADD_REPAYMENT_ORDER_PARAMS, "AddRepaymentOrder") &&
+            checkParams(query, COMPLETE_REPAYMENT_ORDER_PARAMS, "CompleteRepaymentOrder") &&
+            checkParams(query, CLOSE_REPAYMENT_ORDER_PARAMS, "CloseRepaymentOrder") &&
+            checkParams(query, COLLECT_COINS_PARAMS, "CollectCoins") &&
+            checkParams(query, HOUSEKEEPING_PARAMS, "Housekeeping");
+        if (!same)
+            return false;
+    }
+    std::cout << "The parameter schemas agree with the old parsing on " << checked << " sets of parameters" << std::endl;
+    return true;
+}
 
+// a block's reward the way reward paid it before the rewards were summed per wallet: worked out for the block on
+// its own and added to the wallet right away
+static void awardByBlock(std::map<std::string, std::string>* wallets, bool newFormula, boost::multiprecision::cpp_int const& blockIdx, StateAddress const& walletId)
+{
+    BlockReward reward = newFormula ? periodReward((blockIdx / BLOCKS_IN_PERIOD_UPDATE1).convert_to<int>()) : FIXED_REWARD;
+    if (reward.amount > 0)
+    {
+        std::string& stateData = (*wallets)[walletId.hex()];
         Wallet wallet;
         if (stateData.empty())
         {
-            wallet.set_amount(amountString);
+            wallet.set_amount(reward.amountString);
         }
         else
         {
             wallet.ParseFromString(stateData);
             boost::multiprecision::cpp_int balance = getBigint(wallet.amount());
-            balance += amount;
+            balance += reward.amount;
             wallet.set_amount(toString(balance));
         }
-
-        std::vector<sawtooth::GlobalState::KeyValue> states;
-        addState(&states, walletId, wallet);
-        states.push_back(sawtooth::GlobalState::KeyValue(id, amountString));
-        setState(state, states);
+        wallet.SerializeToString(&stateData);
     }
+}
 
-    void Housekeeping(nlohmann::json const& query)
+// a check of the coalesced block rewards: runs of blocks mined by a handful of wallets, some of which hold a balance
+// already, are awarded a block at a time the old way and once through Awards, and the wallets have to end up the
+// same. The runs start around the reward period boundaries, the end of the schedule and the first blocks, with
+// the new formula and without; false on the first difference
+static bool verifyRewards()
+{
+    // the applicator keeps what it writes in its context
+    transitioning = true;
+    std::vector<boost::multiprecision::cpp_int> boundaries;
+    for (std::size_t period = 0; period <= REWARD_SCHEDULE.size() + 1; ++period)
     {
-        boost::multiprecision::cpp_int blockIdx;
-        std::string ignore = getBigint(query, "p1", "blockIdx", &blockIdx);
+        boundaries.push_back(BLOCKS_IN_PERIOD_UPDATE1 * period);
+    }
 
-        const std::string processedBlockIdx = namespacePrefix + PROCESSED_BLOCK + PROCESSED_BLOCK_ID;
-        std::string stateData = getStateData(processedBlockIdx);
-        boost::multiprecision::cpp_int lastProcessedBlockIdx = 0;
-        if (!stateData.empty())
-        {
-            lastProcessedBlockIdx = getBigint(stateData);
-        }
+    std::mt19937_64 random(1);
+    std::size_t blocksAwarded = 0;
+    for (int run = 0; run < 5000; ++run)
+    {
+        sawtooth::TransactionUPtr txn(new sawtooth::Transaction(sawtooth::TransactionHeaderPtr(), std::make_shared<std::string>(),
+            std::make_shared<std::string>(), std::make_shared<std::string>()));
+        Applicator applicator(std::move(txn), sawtooth::GlobalStateUPtr());
+        std::map<std::string, std::string> expected;
 
-        if (blockIdx == 0)
+        std::vector<StateAddress> miners;
+        for (std::size_t i = 0, count = 1 + random() % 5; i < count; ++i)
         {
-            boost::multiprecision::cpp_int head = lastBlockInt(ctx);
-            if (lastProcessedBlockIdx + CONFIRMATION_COUNT * 2 + BLOCK_REWARD_PROCESSING_COUNT < head)
+            miners.push_back(makeAddress(WALLET, std::to_string(run) + " " + std::to_string(i)));
+            if (random() % 2 == 0)
             {
-                reward(lastProcessedBlockIdx, 0);
-                setState(state, processedBlockIdx, toString(lastProcessedBlockIdx + BLOCK_REWARD_PROCESSING_COUNT));
+                Wallet wallet;
+                wallet.set_amount(toString(randomBigint(random, random() % 300)));
+                std::string stateData;
+                wallet.SerializeToString(&stateData);
+                applicator.ctx.currentState[miners.back().hex()] = stateData;
+                expected[miners.back().hex()] = stateData;
             }
-            return;
         }
 
-        verifyGatewaySigner();
+        bool newFormula = random() % 4 != 0;
+        std::size_t blocks = 1 + random() % (4 * BLOCK_REWARD_PROCESSING_COUNT);
+        boost::multiprecision::cpp_int processed = boundaries[random() % boundaries.size()] + (random() % (2 * blocks + 1)) - blocks;
+        if (processed < 0)
+            processed = 0;
 
-        if (blockIdx < CONFIRMATION_COUNT * 2 || blockIdx <= lastProcessedBlockIdx)
+        Applicator::Awards awards;
+        for (boost::multiprecision::cpp_int i = processed + 1; i <= processed + blocks; ++i)
         {
-            return;
+            StateAddress const& miner = miners[random() % miners.size()];
+            Applicator::addAward(&awards, newFormula, i, miner);
+            awardByBlock(&expected, newFormula, i, miner);
         }
+        applicator.award(awards);
+        blocksAwarded += blocks;
 
-        boost::multiprecision::cpp_int tip = lastBlockInt(ctx);
-        if (blockIdx >= tip - CONFIRMATION_COUNT)
+        if (applicator.ctx.currentState != expected)
         {
-            LOG4CXX_INFO(logger, "Premature processing");
-            return;
+            std::cerr << "Rewards for " << blocks << " blocks after " << processed << (newFormula ? " with" : " without")
+                << " the new formula differ from rewarding them block by block" << std::endl;
+            return false;
         }
-
-        Applicator* applicator = this;
-        sawtooth::GlobalState* s = state.get();
-        filter(ctx, namespacePrefix + ASK_ORDER, [applicator, blockIdx, s](std::string const& address, std::string const& protobuf) {
-            AskOrder askOrder;
-            askOrder.ParseFromString(protobuf);
-            boost::multiprecision::cpp_int start = getBigint(askOrder.block());
-            boost::multiprecision::cpp_int elapsed = blockIdx - start;
-            if (askOrder.expiration() < elapsed)
-            {
-                applicator->deleteState(s, address);
-            }
-        });
-        filter(ctx, namespacePrefix + BID_ORDER, [applicator, blockIdx, s](std::string const& address, std::string const& protobuf) {
-            BidOrder bidOrder;
-            bidOrder.ParseFromString(protobuf);
-            boost::multiprecision::cpp_int start = getBigint(bidOrder.block());
-            boost::multiprecision::cpp_int elapsed = blockIdx - start;
-            if (bidOrder.expiration() < elapsed)
-            {
-                applicator->deleteState(s, address);
-            }
-        });
-        filter(ctx, namespacePrefix + OFFER, [applicator, blockIdx, s](std::string const& address, std::string const& protobuf) {
-            Offer offer;
-            offer.ParseFromString(protobuf);
-            boost::multiprecision::cpp_int start = getBigint(offer.block());
-            boost::multiprecision::cpp_int elapsed = blockIdx - start;
-            if (offer.expiration() < elapsed)
-            {
-                applicator->deleteState(s, address);
-            }
-        });
-        filter(ctx, namespacePrefix + DEAL_ORDER, [applicator, blockIdx, s](std::string const& address, std::string const& protobuf) {
-            DealOrder dealOrder;
-            dealOrder.ParseFromString(protobuf);
-            boost::multiprecision::cpp_int start = getBigint(dealOrder.block());
-            boost::multiprecision::cpp_int elapsed = blockIdx - start;
-            if (dealOrder.expiration() < elapsed && dealOrder.loan_transfer().empty())
-            {
-                if (!applicator->ctx.tip || applicator->ctx.tip && applicator->ctx.tip > dealExpFixBlock)
-                {
-                    const std::string walletId = namespacePrefix + WALLET + dealOrder.sighash();
-                    std::string stateData = applicator->getStateData(s, walletId, true);
-                    Wallet wallet;
-                    wallet.ParseFromString(stateData);
-                    boost::multiprecision::cpp_int balance = getBigint(wallet.amount());
-                    balance += getBigint(dealOrder.fee());
-                    wallet.set_amount(toString(balance));
-
-                    std::vector<sawtooth::GlobalState::KeyValue> states;
-                    addState(&states, walletId, wallet);
-                    applicator->setState(s, states);
-                }
-                applicator->deleteState(s, address);
-            }
-        });
-        filter(ctx, namespacePrefix + REPAYMENT_ORDER, [applicator, blockIdx, s](std::string const& address, std::string const& protobuf) {
-            RepaymentOrder repaymentOrder;
-            repaymentOrder.ParseFromString(protobuf);
-            boost::multiprecision::cpp_int start = getBigint(repaymentOrder.block());
-            boost::multiprecision::cpp_int elapsed = blockIdx - start;
-            if (repaymentOrder.expiration() < elapsed && repaymentOrder.previous_owner().empty())
-            {
-                applicator->deleteState(s, address);
-            }
-        });
-        filter(ctx, namespacePrefix + FEE, [applicator, blockIdx, s](std::string const& address, std::string const& protobuf) {
-            Fee fee;
-            fee.ParseFromString(protobuf);
-            boost::multiprecision::cpp_int start(fee.block());
-            boost::multiprecision::cpp_int elapsed = blockIdx - start;
-            if (YEAR_OF_BLOCKS < elapsed)
-            {
-                const std::string walletId = namespacePrefix + WALLET + fee.sighash();
-                std::string stateData;
-                if (!applicator->getState(s, &stateData, walletId) || stateData.empty())
-                {
-                    throw sawtooth::InvalidTransaction("Existing state expected " + walletId);
-                }
-                Wallet wallet;
-                wallet.ParseFromString(stateData);
-                wallet.set_amount(toString(getBigint(wallet.amount()) + TX_FEE));
-
-                wallet.SerializeToString(&stateData);
-                applicator->setState(s, walletId, stateData);
-                applicator->deleteState(s, address);
-            }
-        });
-
-        reward(lastProcessedBlockIdx, blockIdx);
-        setState(state, processedBlockIdx, toString(blockIdx));
     }
-};
+    std::cout << "Coalesced rewards match rewarding block by block on " << blocksAwarded << " blocks" << std::endl;
+    return true;
+}
 
-class Handler : public sawtooth::TransactionHandler
+// a benchmark of the expiry index on a million deal orders expiring over a year of blocks, in an in-memory state:
+// Housekeeping without the index decides on every order, with it only on the ones listed in the buckets that came
+// due since the last sweep. The round trips to the validator grow with the entries read the same way the time
+// does; false if the two find different orders due
+static bool benchExpiryIndex()
 {
-public:
-    Handler()
-    {
-    }
-
-    std::string transaction_family_name() const
+    const std::size_t ORDERS = 1000000;
+    std::vector<std::pair<std::string, std::string>> entries;
+    entries.reserve(2 * ORDERS);
+    for (std::size_t i = 0; i < ORDERS; ++i)
     {
-        return NAMESPACE;
-    }
-
-    std::list<std::string> versions() const
-    {
-        return { "1.0", "1.1", "1.2", "1.3", "1.4", "1.5", "1.6", "1.7" };
+        DealOrder order;
+        order.set_block("0");
+        order.set_expiration((i * 2654435761u) % YEAR_OF_BLOCKS);
+        order.set_sighash(sha512(std::to_string(i)).substr(0, 60));
+        order.set_fee(TX_FEE_STRING);
+        std::string protobuf;
+        order.SerializeToString(&protobuf);
+        StateAddress address = makeAddress(DEAL_ORDER, std::to_string(i));
+        entries.push_back(std::make_pair(address.hex(), protobuf));
+        entries.push_back(std::make_pair(expiryEntry(order.expiration() + 1, address).hex(),
+            std::string(reinterpret_cast<char const*>(address.bytes), StateAddress::SIZE)));
     }
+    std::sort(entries.begin(), entries.end());
+    PersistentState state = PersistentState::fromSorted(&entries);
 
-    std::list<std::string> namespaces() const
+    // a Housekeeping a block after the last one, halfway through the expirations
+    Ctx ctx;
+    const boost::multiprecision::cpp_int blockIdx = YEAR_OF_BLOCKS / 2;
+    const boost::multiprecision::cpp_int swept = blockIdx - 1;
+    const std::string orders = namespacePrefix + DEAL_ORDER;
+    std::size_t scanned = 0;
+    std::size_t scannedDue = 0;
+    std::size_t listed = 0;
+    std::size_t listedDue = 0;
+    double scanMs = std::numeric_limits<double>::max();
+    double indexMs = std::numeric_limits<double>::max();
+    for (int round = 0; round < 3; ++round)
     {
-        return { namespacePrefix };
+        scanned = 0;
+        scannedDue = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (PersistentState::Cursor i(state, orders); i.valid() && i.key().rfind(orders, 0) == 0; i.next())
+        {
+            Applicator::Verdict verdict;
+            Applicator::decideDealOrder(ctx, blockIdx, i.value(), &verdict);
+            ++scanned;
+            // the ones expired before the buckets of this sweep were taken by the sweeps before it
+            if (verdict.expired && verdict.expiresAt / EXPIRY_BUCKET_BLOCKS >= swept / EXPIRY_BUCKET_BLOCKS)
+                ++scannedDue;
+        }
+        auto middle = std::chrono::steady_clock::now();
+        listed = 0;
+        listedDue = 0;
+        for (boost::multiprecision::cpp_int bucket = swept / EXPIRY_BUCKET_BLOCKS; bucket <= blockIdx / EXPIRY_BUCKET_BLOCKS; ++bucket)
+        {
+            std::string prefix = expiryPrefix(bucket);
+            for (PersistentState::Cursor i(state, prefix); i.valid() && i.key().rfind(prefix, 0) == 0; i.next())
+            {
+                StateAddress order;
+                std::memcpy(order.bytes, i.value().data(), StateAddress::SIZE);
+                std::string protobuf;
+                if (!state.find(order.hex(), &protobuf))
+                    continue;
+                Applicator::Verdict verdict;
+                Applicator::decideDealOrder(ctx, blockIdx, protobuf, &verdict);
+                ++listed;
+                if (verdict.expired)
+                    ++listedDue;
+            }
+        }
+        auto finished = std::chrono::steady_clock::now();
+        scanMs = std::min(scanMs, std::chrono::duration<double, std::milli>(middle - started).count());
+        indexMs = std::min(indexMs, std::chrono::duration<double, std::milli>(finished - middle).count());
     }
+    std::cout << "Housekeeping over " << ORDERS << " deal orders: the scan decides on " << scanned << " in " << scanMs
+        << " ms, the expiry index lists " << listed << " in " << indexMs << " ms; " << listedDue << " due"
+        << (scannedDue == listedDue ? "" : ", the scan finds a different number") << std::endl;
+    return scannedDue == listedDue;
+}
 
-    sawtooth::TransactionApplicatorUPtr GetApplicator(sawtooth::TransactionUPtr txn, sawtooth::GlobalStateUPtr state)
+static void setupSettingsAndExternalGatewayAddress()
+{
+    // the text file of an older deployment is converted once, replays map the result; a result of an earlier
+    // converter is converted again rather than refused
+    bool outdated = TransitionData::outdated(transitionDataFile);
+    if ((outdated || !std::ifstream(transitionDataFile).good()) && std::ifstream(transitionFile).good())
     {
-        return sawtooth::TransactionApplicatorUPtr(new Applicator(std::move(txn), std::move(state)));
+        if (outdated)
+            std::cout << transitionDataFile << " is from an earlier version, converting " << transitionFile << " again" << std::endl;
+        if (!convertTransitionFile(transitionFile, transitionDataFile))
+            throw std::runtime_error("can't convert the transition file");
     }
-};
 
-static void setupSettingsAndExternalGatewayAddress()
-{
-    std::ifstream migrationData(transitionFile);
-    if (!static_cast<bool>(migrationData.good()))
+    if (!blocks.open(transitionDataFile))
     {
         assert(updatingSettings.get() == nullptr);
         updatingSettings.reset(new std::thread(updateSettings));
@@ -2463,40 +6552,9 @@ static void setupSettingsAndExternalGatewayAddress()
     else
     {
         transitioning = true;
-        for (;;)
-        {
-            std::string line;
-            std::getline(migrationData, line);
-            if (line.length() == 0)
-                break;
-            int blockIdx = getBigint(line).convert_to<int>();
-            std::getline(migrationData, line);
-            if (blocks.size() <= blockIdx)
-            {
-                int size = blockIdx + 1;
-                blocks.resize(size);
-            }
-            SimpleBlock b;
-            b.signer = line;
-            int txCount = 0;
-            for (; ; ++txCount)
-            {
-                std::getline(migrationData, line);
-                if (line == ".")
-                    break;
-                txguid2prevblockidx[line] = TxPos(blockIdx - 1, txCount);
-                Tx tx;
-                tx.guid = line;
-                std::getline(migrationData, line);
-                tx.sighash = line;
-                std::getline(migrationData, line);
-                tx.payload = decodeBase64(line);
-                b.txs.push_back(std::move(tx));
-            }
-            blocks[blockIdx] = std::move(b);
-        }
         updatedBlockIdx = 0;
-        updatedTxIdx = blocks[updatedBlockIdx].txs.size() - 1;
+        updatedTxIdx = blocks.txCount(updatedBlockIdx) - 1;
+        restoreCheckpoint();
     }
 }
 
@@ -2522,6 +6580,39 @@ int main(int argc, char** argv)
     // console4> ccprocessor
     // console5> ccclient creditcoin tmpAddDeal bitcoin mvJr4KdZdx7NzJL87Xx5FNstP1tttbGvq2 10500 bitcoin mp3PRSq1ZKtSDxTqSwWSBLCm3EauHcVD7g 10000
     // console5> ccclient bitcoin registerTransfer 8a1a04aa595e25f63564472cebc9337366bcd4495aee0c50130e0b32975d78313ff35b
+    if (argc == 2 && std::strcmp(argv[1], "-convertTransition") == 0)
+    {
+        return convertTransitionFile(transitionFile, transitionDataFile) ? 0 : 1;
+    }
+    if (argc == 2 && std::strcmp(argv[1], "-benchExpiryIndex") == 0)
+    {
+        return benchExpiryIndex() ? 0 : 1;
+    }
+    if (argc == 2 && std::strcmp(argv[1], "-verifyReplay") == 0)
+    {
+        log4cxx::BasicConfigurator::configure();
+        return verifyReplay() ? 0 : 1;
+    }
+    if (argc == 2 && std::strcmp(argv[1], "-verifyInterest") == 0)
+    {
+        return verifyInterest() ? 0 : 1;
+    }
+    if (argc == 2 && std::strcmp(argv[1], "-verifyPayloads") == 0)
+    {
+        return verifyPayloads() ? 0 : 1;
+    }
+    if (argc == 2 && std::strcmp(argv[1], "-verifyAmounts") == 0)
+    {
+        return verifyAmounts() ? 0 : 1;
+    }
+    if (argc == 2 && std::strcmp(argv[1], "-verifyParams") == 0)
+    {
+        return verifyParams() ? 0 : 1;
+    }
+    if (argc == 2 && std::strcmp(argv[1], "-verifyRewards") == 0)
+    {
+        return verifyRewards() ? 0 : 1;
+    }
     parseArgs(argc, argv);
 
     zmqpp::context context;